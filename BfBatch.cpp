@@ -0,0 +1,207 @@
+#include "BfBatch.h"
+#include "BfRuntime.h"
+#include "BfTape.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace bf;
+
+// Batch runner
+//  Every worker thread has a queue of runs. Workers take runs from the front
+//  of their own queue and, once it is empty, steal from the back of the
+//  others. The main thread writes the results in order as they finish.
+//
+
+//Queue of runs belonging to one worker
+struct WorkQueue
+{
+    mutex lock;
+    deque<size_t> runs;
+};
+
+//Result of a single run
+struct RunResult
+{
+    string output;
+    bool done;
+    char const * error;     // Error message (NULL if the run succeeded)
+};
+
+//State shared by all the threads
+struct Batch
+{
+    void const * code;
+    size_t tapeSize;
+    vector<string> const * inputs;
+
+    vector<unique_ptr<WorkQueue> > queues;
+
+    vector<RunResult> results;
+    mutex resultsLock;
+    condition_variable resultDone;
+};
+
+//Gets the next run for the given worker
+// Returns false if there are no runs left
+static bool takeRun(Batch& batch, size_t worker, size_t& run)
+{
+    //Take from the front of our own queue
+    {
+        WorkQueue& own = *batch.queues[worker];
+        lock_guard<mutex> lock(own.lock);
+
+        if(!own.runs.empty())
+        {
+            run = own.runs.front();
+            own.runs.pop_front();
+            return true;
+        }
+    }
+
+    //Steal from the back of another queue
+    // Runs are never added so if every queue is empty, we're finished
+    for(size_t i = 1; i < batch.queues.size(); i++)
+    {
+        WorkQueue& other = *batch.queues[(worker + i) % batch.queues.size()];
+        lock_guard<mutex> lock(other.lock);
+
+        if(!other.runs.empty())
+        {
+            run = other.runs.back();
+            other.runs.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//Opens an input file for reading
+static int openInput(string const& path)
+{
+#ifdef _WIN32
+    return ::_open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    return ::open(path.c_str(), O_RDONLY);
+#endif
+}
+
+static void closeInput(int fd)
+{
+#ifdef _WIN32
+    ::_close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+//Runs runs until there are none left
+static void worker(Batch& batch, size_t id)
+{
+    Tape tape(batch.tapeSize);
+    FileRuntime runtime;
+    size_t run;
+
+    while(takeRun(batch, id, run))
+    {
+        RunResult& result = batch.results[run];
+        char const * error = NULL;
+        int fd = -1;
+
+        if(!tape.valid())
+            error = "Failed to allocate heap memory for input file: ";
+        else if((fd = openInput((*batch.inputs)[run])) < 0)
+            error = "Failed to open input file: ";
+        else
+        {
+            //Run the code with a clean tape
+            runtime.reset(fd, &result.output);
+            execute(batch.code, tape.getStart(), runtime.get());
+            runtime.reset(0, NULL);
+
+            closeInput(fd);
+            tape.clear();
+        }
+
+        lock_guard<mutex> lock(batch.resultsLock);
+        result.error = error;
+        result.done = true;
+        batch.resultDone.notify_all();
+    }
+}
+
+bool bf::runBatch(void const * code, std::size_t tapeSize,
+    std::vector<std::string> const& inputs, unsigned threads)
+{
+    if(threads == 0)
+        threads = thread::hardware_concurrency();
+    if(threads == 0)
+        threads = 1;
+    if(threads > inputs.size())
+        threads = static_cast<unsigned>(inputs.size());
+
+    Batch batch;
+    batch.code = code;
+    batch.tapeSize = tapeSize;
+    batch.inputs = &inputs;
+
+    RunResult empty = { string(), false, NULL };
+    batch.results.assign(inputs.size(), empty);
+
+    //Deal the runs out in turn so the early ones finish first
+    for(unsigned i = 0; i < threads; i++)
+        batch.queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+
+    for(size_t i = 0; i < inputs.size(); i++)
+        batch.queues[i % threads]->runs.push_back(i);
+
+    vector<thread> workers;
+    for(unsigned i = 0; i < threads; i++)
+        workers.push_back(thread(worker, ref(batch), i));
+
+    //Write the results in order
+    bool ok = true;
+
+    for(size_t i = 0; i < inputs.size(); i++)
+    {
+        RunResult& result = batch.results[i];
+
+        {
+            unique_lock<mutex> lock(batch.resultsLock);
+            while(!result.done)
+                batch.resultDone.wait(lock);
+        }
+
+        if(result.error != NULL)
+        {
+            cerr << result.error << inputs[i] << endl;
+            ok = false;
+        }
+
+        writeFile(1, result.output.data(), result.output.size());
+        string().swap(result.output);
+    }
+
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    return ok;
+}
@@ -0,0 +1,27 @@
+#ifndef _BFBATCH_H
+#define _BFBATCH_H
+
+// Brainfuck Batch Runner
+//
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace bf
+{
+    // Runs compiled code once for each of a list of input files
+    //  The runs are spread over several threads, each with its own tape and
+    //  buffers. The code is shared so it must not be modified while running.
+    //  The output of each run is written to stdout in the order of the inputs.
+    //  code         = Compiled code (must be executable)
+    //  tapeSize     = Maximum size of each tape (in bytes)
+    //  inputs       = Files to read input from
+    //  threads      = Number of threads to use (0 for one per processor)
+    //  Returns false if any input could not be run (an error is printed and
+    //  the other inputs are still run)
+    bool runBatch(void const * code, std::size_t tapeSize,
+        std::vector<std::string> const& inputs, unsigned threads = 0);
+}
+
+#endif
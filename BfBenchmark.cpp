@@ -0,0 +1,389 @@
+#include "BfBenchmark.h"
+#include "BfCodeBuffer.h"
+#include "BfIr.h"
+#include "BfRuntime.h"
+#include "BfTape.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+using namespace std;
+using namespace bf;
+
+// Benchmarks
+//  Compile time and execution time are measured separately, taking the best
+//  of several runs. The operations run are counted by the interpreter and the
+//  instructions run by the processor's performance counters.
+//
+
+//Number of times each program is compiled and run
+#define BENCHMARK_RUNS 5
+
+//Size of the input of the echo benchmark
+#define ECHO_INPUT_SIZE (16 * 1024 * 1024)
+
+//Number of cells scanned over by the scan benchmark
+#define SCAN_CELLS 16384
+
+//A program to benchmark
+struct Workload
+{
+    string name;
+    string source;
+    string input;
+};
+
+//Measurements of a workload
+struct Measurements
+{
+    size_t sourceSize;
+    size_t irOps;
+    uint32_t codeSize;
+    double compileTime;         // Seconds
+    double executionTime;       // Seconds
+    uint64_t opsRun;
+    uint64_t instructions;      // 0 if not counted
+};
+
+//Creates the built-in workloads
+static void addBuiltinWorkloads(vector<Workload>& workloads)
+{
+    //Nested loops which aren't replaced by the loop idiom pass
+    Workload longLoop = { "long-loop", "++[>-[>-[>-[>-[>+<-]<-]<-]<-]<-]", "" };
+
+    //Copies and multiplies within a loop
+    Workload arithmetic =
+    {
+        "arithmetic",
+        "-[>-[>-[>+++>--->++>-<<<<>[->>>>>+>+<<<<<<]>>>>>>[-<<<<<<+>>>>>>]<<<<<<<-]<-]<-]",
+        ""
+    };
+
+    //Copies its input to its output (stopping at EOF or a zero byte)
+    Workload echo = { "echo", ",+[-.,+]", "" };
+    for(size_t i = 0; i < ECHO_INPUT_SIZE; i++)
+        echo.input.push_back(static_cast<char>('a' + i % 26));
+
+    //Scans over a long run of non-zero cells in each direction
+    // (cell 0 and 1 are counters and cell 2 is zero)
+    Workload scan = { "scan", ">>>", "" };
+    for(size_t i = 0; i < SCAN_CELLS; i++)
+        scan.source.append("+>");
+
+    scan.source.append(SCAN_CELLS + 3, '<');
+    scan.source.append("-[>-[>>[>]<[<]<-]<-]");
+
+    workloads.push_back(longLoop);
+    workloads.push_back(arithmetic);
+    workloads.push_back(echo);
+    workloads.push_back(scan);
+}
+
+//Reads a whole file into a string
+// Returns false if the file cannot be read
+static bool readFile(string const& path, string& contents)
+{
+    ifstream file(path.c_str(), ios::in | ios::binary);
+    if(!file)
+        return false;
+
+    ostringstream stream;
+    stream << file.rdbuf();
+    contents = stream.str();
+    return !file.bad();
+}
+
+//Opens a counter of the instructions run in user mode by this thread
+// Returns -1 if it is not supported
+static int openInstructionCounter()
+{
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+    return -1;
+#endif
+}
+
+//Starts counting from zero
+static void startCounter(int counter)
+{
+#ifdef __linux__
+    ::ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ::ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+#else
+    (void) counter;
+#endif
+}
+
+//Stops counting and returns the count (0 on errors)
+static uint64_t stopCounter(int counter)
+{
+    uint64_t count = 0;
+
+#ifdef __linux__
+    ::ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if(::read(counter, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+#else
+    (void) counter;
+#endif
+
+    return count;
+}
+
+static void closeCounter(int counter)
+{
+#ifdef __linux__
+    ::close(counter);
+#else
+    (void) counter;
+#endif
+}
+
+//Gets the seconds since the given time
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+//Prepares a runtime and tape to run a workload
+static void startRun(FileRuntime& runtime, Tape& tape, Workload const& workload, string& output)
+{
+    tape.clear();
+    output.clear();
+
+    //The input is read straight from memory
+    runtime.reset(-1, &output);
+
+    Runtime& r = runtime.get();
+    r.tape = static_cast<uint8_t *>(tape.getStart());
+    r.inputPos = reinterpret_cast<uint8_t *>(const_cast<char *>(workload.input.data()));
+    r.inputEnd = r.inputPos + workload.input.size();
+    r.inputEof = true;
+}
+
+//Measures a workload
+// Returns false if it could not be compiled
+static bool measure(Workload const& workload, CodeBuffer& code, CompilerState& state,
+                    Tape& tape, Measurements& result)
+{
+    result.sourceSize = workload.source.size();
+    result.irOps = 0;
+    result.codeSize = 0;
+    result.compileTime = 0;
+    result.executionTime = 0;
+    result.instructions = 0;
+    result.opsRun = 0;
+
+    //Compile it
+    for(int i = 0; i < BENCHMARK_RUNS; i++)
+    {
+        if(!code.protectWritable())
+            return false;
+
+        state.reset();
+
+        istringstream source(workload.source);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        if(compile(source, state) != OK)
+            return false;
+
+        double time = secondsSince(start);
+        if(i == 0 || time < result.compileTime)
+            result.compileTime = time;
+    }
+
+    if(!code.protectExecutable())
+        return false;
+
+    result.codeSize = state.getPosition();
+
+    //Run it (counting the instructions of the first run)
+    FileRuntime runtime;
+    string output;
+    int counter = openInstructionCounter();
+
+    for(int i = 0; i < BENCHMARK_RUNS; i++)
+    {
+        startRun(runtime, tape, workload, output);
+
+        if(i == 0 && counter >= 0)
+            startCounter(counter);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        execute(code.getStart(), tape.getStart(), runtime.get());
+        double time = secondsSince(start);
+
+        if(i == 0 && counter >= 0)
+            result.instructions = stopCounter(counter);
+
+        if(i == 0 || time < result.executionTime)
+            result.executionTime = time;
+    }
+
+    if(counter >= 0)
+        closeCounter(counter);
+
+    //Count the operations run by interpreting the optimized program
+    ir::Program program;
+    istringstream source(workload.source);
+
+    if(ir::parse(source, program) != OK)
+        return false;
+
+    ir::PassManager passes;
+    ir::addDefaultPasses(passes);
+    passes.run(program);
+
+    startRun(runtime, tape, workload, output);
+    result.irOps = program.size();
+    result.opsRun = interpret(program, state, runtime.get());
+    return true;
+}
+
+//Writes a string as a JSON string
+static void writeJsonString(ostream& output, string const& str)
+{
+    output << '"';
+
+    for(size_t i = 0; i < str.size(); i++)
+    {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+
+        if(c == '"' || c == '\\')
+        {
+            output << '\\' << c;
+        }
+        else if(c < 0x20)
+        {
+            char escape[8];
+            sprintf(escape, "\\u%04x", c);
+            output << escape;
+        }
+        else
+        {
+            output << c;
+        }
+    }
+
+    output << '"';
+}
+
+//Writes the measurements of a workload as a JSON object
+static void writeJson(ostream& output, string const& name, Measurements const& result)
+{
+    output << "    {\n";
+    output << "      \"name\": ";
+    writeJsonString(output, name);
+    output << ",\n";
+    output << "      \"sourceSize\": " << result.sourceSize << ",\n";
+    output << "      \"irOps\": " << result.irOps << ",\n";
+    output << "      \"codeSize\": " << result.codeSize << ",\n";
+    output << "      \"compileTime\": " << result.compileTime << ",\n";
+    output << "      \"executionTime\": " << result.executionTime << ",\n";
+    output << "      \"opsRun\": " << result.opsRun << ",\n";
+
+    if(result.instructions != 0)
+    {
+        output << "      \"instructions\": " << result.instructions << ",\n";
+        output << "      \"instructionsPerOp\": " <<
+            static_cast<double>(result.instructions) / (result.opsRun != 0 ? result.opsRun : 1) << "\n";
+    }
+    else
+    {
+        output << "      \"instructions\": null,\n";
+        output << "      \"instructionsPerOp\": null\n";
+    }
+
+    output << "    }";
+}
+
+bool bf::runBenchmarks(std::vector<std::string> const& files, std::ostream& output,
+    std::size_t codeSize, std::size_t tapeSize, std::uint8_t cellSize, EofCode eofCode)
+{
+    //Collect the workloads
+    vector<Workload> workloads;
+    addBuiltinWorkloads(workloads);
+
+    for(size_t i = 0; i < files.size(); i++)
+    {
+        Workload workload;
+        workload.name = files[i];
+
+        if(!readFile(files[i], workload.source))
+        {
+            cerr << "Failed to open input file: " << files[i] << endl;
+            return false;
+        }
+
+        readFile(files[i] + ".in", workload.input);
+        workloads.push_back(workload);
+    }
+
+    //Allocate memory
+    CodeBuffer code(codeSize);
+    Tape tape(tapeSize);
+
+    if(!code.valid() || !tape.valid())
+    {
+        cerr << "Failed to allocate memory for benchmarks" << endl;
+        return false;
+    }
+
+    CompilerState state(code, cellSize, eofCode);
+
+    //Run them
+    output << "{\n";
+    output << "  \"arch\": \"" << (state.getArchitecture() == ARCH_X86_64 ? "x86-64" : "x86") << "\",\n";
+    output << "  \"vector\": \"" << (state.getVectorExtension() == VECTOR_AVX2 ? "avx2" :
+        state.getVectorExtension() == VECTOR_SSE2 ? "sse2" : "none") << "\",\n";
+    output << "  \"cellSize\": " << static_cast<unsigned>(cellSize) << ",\n";
+    output << "  \"benchmarks\": [\n";
+
+    bool ok = true;
+    bool first = true;
+
+    for(size_t i = 0; i < workloads.size(); i++)
+    {
+        Measurements result;
+        if(!measure(workloads[i], code, state, tape, result))
+        {
+            cerr << "Failed to compile benchmark: " << workloads[i].name << endl;
+            ok = false;
+            continue;
+        }
+
+        if(!first)
+            output << ",\n";
+
+        writeJson(output, workloads[i].name, result);
+        first = false;
+    }
+
+    output << "\n  ]\n}" << endl;
+    return ok;
+}
@@ -0,0 +1,34 @@
+#ifndef _BFBENCHMARK_H
+#define _BFBENCHMARK_H
+
+// Brainfuck Benchmarks
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "BfCompiler.h"
+
+namespace bf
+{
+    // Runs the built-in benchmark programs followed by the given program files
+    //  Each program is compiled and run several times and the best times are
+    //  written to output as JSON with the size of the code, the number of
+    //  operations run and (where the processor counters can be read) the
+    //  number of instructions run.
+    //  A file's input is read from <file>.in if it exists (otherwise the
+    //  input is empty).
+    //  files        = Program files to run after the built-in programs
+    //  codeSize     = Maximum size of the compiled code (in bytes)
+    //  tapeSize     = Maximum size of the tape (in bytes)
+    //  cellSize     = Size of cells to use (must be 1, 2 or 4, or 8 in x86-64)
+    //  eofCode      = What code to produce on EOF (see bf::EofCode)
+    //  Returns false if any program could not be run (an error is printed)
+    bool runBenchmarks(std::vector<std::string> const& files, std::ostream& output,
+        std::size_t codeSize, std::size_t tapeSize,
+        std::uint8_t cellSize = 1, EofCode eofCode = EofCode(-1));
+}
+
+#endif
@@ -0,0 +1,299 @@
+#include "BfCache.h"
+#include "BfProfile.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace bf;
+
+// Compiled code cache
+//
+
+//Version of the generated code
+// This must be increased whenever the generated code changes so old
+// artifacts are not used
+#define ARTIFACT_VERSION 5
+
+//Offset of the code in an artifact (must be a multiple of the page size)
+#define ARTIFACT_CODE_OFFSET 4096
+
+//Header at the start of every artifact
+struct ArtifactHeader
+{
+    char magic[8];              // ARTIFACT_MAGIC
+    uint64_t key;               // Cache key of the program
+    uint32_t version;           // ARTIFACT_VERSION
+    uint32_t codeSize;          // Size of the code
+    int32_t eofCode;            // EOF code (if eofModify is set)
+    uint8_t arch;               // Architecture
+    uint8_t cellSize;           // Cell size
+    uint8_t vector;             // Vector extension used by the code
+    uint8_t eofModify;          // True if the EOF code is used
+};
+
+static char const ARTIFACT_MAGIC[8] = { 'B', 'F', 'J', 'I', 'T', '\0', '\r', '\n' };
+
+//Reads an artifact header from the given file
+// Returns false if the file does not start with a header
+static bool readHeader(string const& path, ArtifactHeader& header)
+{
+    ifstream file(path.c_str(), ios::in | ios::binary);
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+
+    return file && memcmp(header.magic, ARTIFACT_MAGIC, sizeof(ARTIFACT_MAGIC)) == 0;
+}
+
+bf::Artifact::Artifact()
+    : mapping_(NULL), mappingSize_(0), key_(0)
+{
+}
+
+bf::Artifact::~Artifact()
+{
+    if(mapping_ == NULL)
+        return;
+
+#ifdef _WIN32
+    ::VirtualFree(mapping_, 0, MEM_RELEASE);
+#else
+    ::munmap(mapping_, mappingSize_);
+#endif
+}
+
+bool bf::Artifact::load(std::string const& path)
+{
+    ArtifactHeader header;
+    if(mapping_ != NULL || !readHeader(path, header))
+        return false;
+
+    //Only load code which can be run here
+    if(header.version != ARTIFACT_VERSION || header.arch != ARCH_NATIVE ||
+        header.vector > detectVectorExtension() || header.codeSize == 0)
+    {
+        return false;
+    }
+
+    size_t size = ARTIFACT_CODE_OFFSET + header.codeSize;
+
+#ifdef _WIN32
+    //Read the file into memory and make it executable
+    ifstream file(path.c_str(), ios::in | ios::binary);
+    void * mapping = ::VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if(mapping == NULL)
+        return false;
+
+    DWORD oldProtect;
+    if(!file.read(static_cast<char *>(mapping), size) ||
+        !::VirtualProtect(mapping, size, PAGE_EXECUTE_READ, &oldProtect))
+    {
+        ::VirtualFree(mapping, 0, MEM_RELEASE);
+        return false;
+    }
+#else
+    //Map the file directly
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat info;
+    if(::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < size)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void * mapping = ::mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if(mapping == MAP_FAILED)
+        return false;
+#endif
+
+    mapping_ = mapping;
+    mappingSize_ = size;
+    key_ = header.key;
+    return true;
+}
+
+bool bf::Artifact::valid() const
+{
+    return mapping_ != NULL;
+}
+
+void const * bf::Artifact::getCode() const
+{
+    return static_cast<char const *>(mapping_) + ARTIFACT_CODE_OFFSET;
+}
+
+std::uint64_t bf::Artifact::getKey() const
+{
+    return key_;
+}
+
+bool bf::isArtifact(std::string const& path)
+{
+    ArtifactHeader header;
+    return readHeader(path, header);
+}
+
+bool bf::saveArtifact(std::string const& path, CompilerState const& state, std::uint64_t key)
+{
+    //Create header
+    char page[ARTIFACT_CODE_OFFSET];
+    memset(page, 0, sizeof(page));
+
+    ArtifactHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARTIFACT_MAGIC, sizeof(ARTIFACT_MAGIC));
+    header.key = key;
+    header.version = ARTIFACT_VERSION;
+    header.codeSize = state.getPosition();
+    header.eofCode = state.getEofCode().code;
+    header.arch = static_cast<uint8_t>(state.getArchitecture());
+    header.cellSize = state.getCellSize();
+    header.vector = static_cast<uint8_t>(state.getVectorExtension());
+    header.eofModify = state.getEofCode().modifyValue;
+    memcpy(page, &header, sizeof(header));
+
+    //Write to a temporary file
+#ifdef _WIN32
+    int pid = ::_getpid();
+#else
+    int pid = static_cast<int>(::getpid());
+#endif
+
+    ostringstream tempPath;
+    tempPath << path << '.' << pid << ".tmp";
+
+    {
+        ofstream file(tempPath.str().c_str(), ios::out | ios::trunc | ios::binary);
+        file.write(page, sizeof(page));
+        file.write(static_cast<char const *>(state.getAddress(0)), header.codeSize);
+
+        if(!file.flush())
+        {
+            file.close();
+            remove(tempPath.str().c_str());
+            return false;
+        }
+    }
+
+    //Replace the real file
+#ifdef _WIN32
+    if(!::MoveFileExA(tempPath.str().c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+    if(::rename(tempPath.str().c_str(), path.c_str()) != 0)
+#endif
+    {
+        remove(tempPath.str().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+//Adds the given bytes to a 64-bit FNV-1a hash
+static void hashBytes(uint64_t& hash, void const * data, size_t size)
+{
+    uint8_t const * bytes = static_cast<uint8_t const *>(data);
+
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+}
+
+std::uint64_t bf::getCacheKey(std::string const& source, CompilerState const& state)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    uint32_t options[10] =
+    {
+        ARTIFACT_VERSION,
+        static_cast<uint32_t>(state.getArchitecture()),
+        static_cast<uint32_t>(state.getVectorExtension()),
+        state.getCellSize(),
+        state.getEofCode().modifyValue,
+        static_cast<uint32_t>(state.getEofCode().code),
+        state.getBudgetChecks(),
+        state.getProfile() != NULL && state.getProfile()->getMode() == Profile::COUNT,
+        static_cast<uint32_t>(state.getPrefixSteps()),
+        static_cast<uint32_t>(state.getPrefixSteps() >> 32),
+    };
+
+    hashBytes(hash, options, sizeof(options));
+    hashBytes(hash, source.data(), source.size());
+    return hash;
+}
+
+//Creates a directory if it does not already exist
+static bool createDirectory(string const& path)
+{
+#ifdef _WIN32
+    return ::CreateDirectoryA(path.c_str(), NULL) || ::GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    struct stat info;
+    return ::mkdir(path.c_str(), 0755) == 0 || (::stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode));
+#endif
+}
+
+std::string bf::getCachePath(std::uint64_t key)
+{
+    //Find the cache directory
+    string dir;
+
+#ifdef _WIN32
+    char const * base = getenv("LOCALAPPDATA");
+    if(base == NULL || *base == '\0')
+        return string();
+
+    dir.assign(base);
+#else
+    char const * base = getenv("XDG_CACHE_HOME");
+    if(base != NULL && *base != '\0')
+    {
+        dir.assign(base);
+
+        if(!createDirectory(dir))
+            return string();
+    }
+    else
+    {
+        char const * home = getenv("HOME");
+        if(home == NULL || *home == '\0')
+            return string();
+
+        dir.assign(home);
+        dir.append("/.cache");
+
+        if(!createDirectory(dir))
+            return string();
+    }
+#endif
+
+    dir.append("/bfjit");
+    if(!createDirectory(dir))
+        return string();
+
+    //The key is used as the file name
+    ostringstream path;
+    path << dir << '/' << hex << setfill('0') << setw(16) << key << ".bfc";
+    return path.str();
+}
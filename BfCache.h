@@ -0,0 +1,68 @@
+#ifndef _BFCACHE_H
+#define _BFCACHE_H
+
+// Brainfuck Compiled Code Cache
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "BfCompiler.h"
+
+namespace bf
+{
+    // Compiled code loaded from an artifact file
+    //  Artifacts contain a header describing the options the code was
+    //  compiled with followed by the code itself (starting on a page
+    //  boundary so it can be mapped directly from the file).
+    class Artifact
+    {
+    private:
+        // Memory the artifact is loaded into
+        void * mapping_;
+        std::size_t mappingSize_;
+
+        // Key the code was stored with
+        std::uint64_t key_;
+
+        // Artifacts cannot be copied
+        Artifact(Artifact const&);
+        Artifact& operator=(Artifact const&);
+
+    public:
+        Artifact();
+        ~Artifact();
+
+        // Loads the artifact with the given path
+        //  Returns false if the file does not exist, is not a valid artifact
+        //  or contains code which cannot be executed by this processor
+        bool load(std::string const& path);
+
+        // Returns true if an artifact is loaded
+        bool valid() const;
+
+        // Gets the executable code (pass to bf::execute)
+        void const * getCode() const;
+
+        // Gets the key the code was stored with
+        std::uint64_t getKey() const;
+    };
+
+    // Returns true if the given file starts with the artifact header
+    bool isArtifact(std::string const& path);
+
+    // Writes the code generated by state to an artifact file
+    //  The file is written under a temporary name and then renamed so readers
+    //  never see a partially written artifact
+    bool saveArtifact(std::string const& path, CompilerState const& state, std::uint64_t key);
+
+    // Calculates the key used to cache a program compiled with the options in state
+    std::uint64_t getCacheKey(std::string const& source, CompilerState const& state);
+
+    // Gets the path of the cache file for the given key, creating the cache
+    // directory if needed
+    //  Returns an empty string if there is no cache directory
+    std::string getCachePath(std::uint64_t key);
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include "BfCodeBuffer.h"
+#include <cstddef>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace bf;
+
+// Code memory management
+//
+
+//Amount of memory committed at once
+#define COMMIT_SIZE (64 * 1024)
+
+bf::CodeBuffer::CodeBuffer(std::size_t maxSize)
+    : start_(NULL), maxSize_(0), size_(0)
+{
+    //Reserve the range without committing anything
+    maxSize = (maxSize + COMMIT_SIZE - 1) & ~static_cast<std::size_t>(COMMIT_SIZE - 1);
+
+#ifdef _WIN32
+    void * reserved = ::VirtualAlloc(NULL, maxSize, MEM_RESERVE, PAGE_NOACCESS);
+    if(reserved == NULL)
+        return;
+#else
+    void * reserved = ::mmap(NULL, maxSize, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(reserved == MAP_FAILED)
+        return;
+#endif
+
+    start_ = static_cast<char *>(reserved);
+    maxSize_ = maxSize;
+}
+
+bf::CodeBuffer::~CodeBuffer()
+{
+    if(start_ == NULL)
+        return;
+
+#ifdef _WIN32
+    ::VirtualFree(start_, 0, MEM_RELEASE);
+#else
+    ::munmap(start_, maxSize_);
+#endif
+}
+
+bool bf::CodeBuffer::valid() const
+{
+    return start_ != NULL;
+}
+
+void * bf::CodeBuffer::getStart() const
+{
+    return start_;
+}
+
+std::size_t bf::CodeBuffer::getSize() const
+{
+    return size_;
+}
+
+std::size_t bf::CodeBuffer::getMaxSize() const
+{
+    return maxSize_;
+}
+
+bool bf::CodeBuffer::grow(std::size_t size)
+{
+    if(size <= size_)
+        return true;
+    if(size > maxSize_)
+        return false;
+
+    //Commit the new blocks
+    size = (size + COMMIT_SIZE - 1) & ~static_cast<std::size_t>(COMMIT_SIZE - 1);
+
+#ifdef _WIN32
+    if(::VirtualAlloc(start_ + size_, size - size_, MEM_COMMIT, PAGE_READWRITE) == NULL)
+        return false;
+#else
+    if(::mprotect(start_ + size_, size - size_, PROT_READ | PROT_WRITE) != 0)
+        return false;
+#endif
+
+    size_ = size;
+    return true;
+}
+
+bool bf::CodeBuffer::protectExecutable()
+{
+    if(size_ == 0)
+        return true;
+
+#ifdef _WIN32
+    DWORD oldProtect;
+    return ::VirtualProtect(start_, size_, PAGE_EXECUTE_READ, &oldProtect) != 0;
+#else
+    return ::mprotect(start_, size_, PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+bool bf::CodeBuffer::protectWritable()
+{
+    if(size_ == 0)
+        return true;
+
+#ifdef _WIN32
+    DWORD oldProtect;
+    return ::VirtualProtect(start_, size_, PAGE_READWRITE, &oldProtect) != 0;
+#else
+    return ::mprotect(start_, size_, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
@@ -0,0 +1,59 @@
+#ifndef _BFCODEBUFFER_H
+#define _BFCODEBUFFER_H
+
+// Brainfuck Code Buffer
+//
+
+#include <cstddef>
+
+namespace bf
+{
+    // Memory generated code is written to
+    //  A large range of virtual memory is reserved and pages are committed
+    //  as the code grows, so the code is always contiguous and can be
+    //  written to an artifact or contain relative jumps to any other part.
+    class CodeBuffer
+    {
+    private:
+        // Reserved range
+        char * start_;
+        std::size_t maxSize_;
+
+        // Part of the range which is committed
+        std::size_t size_;
+
+        // Code buffers cannot be copied
+        CodeBuffer(CodeBuffer const&);
+        CodeBuffer& operator=(CodeBuffer const&);
+
+    public:
+        // Reserves a new code buffer with the given maximum size (in bytes)
+        explicit CodeBuffer(std::size_t maxSize);
+        ~CodeBuffer();
+
+        // Returns true if the buffer was reserved successfully
+        bool valid() const;
+
+        // Gets the address of the start of the buffer
+        void * getStart() const;
+
+        // Gets the number of bytes committed
+        std::size_t getSize() const;
+
+        // Gets the maximum size of the buffer
+        std::size_t getMaxSize() const;
+
+        // Commits memory until at least size bytes can be used
+        //  Returns false if the buffer cannot grow that large
+        //  New memory is read-write regardless of the protection of the rest
+        bool grow(std::size_t size);
+
+        // Makes the committed memory read-only and executable
+        bool protectExecutable();
+
+        // Makes the committed memory read-write (it cannot be executed)
+        bool protectWritable();
+    };
+}
+
+#endif
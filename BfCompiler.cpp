@@ -1,369 +1,1816 @@
 #include "BfCompiler.h"
+#include "BfIr.h"
+#include "BfProfile.h"
+#include "BfRuntime.h"
 #include <istream>
-#include <iostream>
+#include <ostream>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
 #include <stack>
+#include <vector>
 
 using namespace std;
 using namespace bf;
 
-//Dummy exception thrown on a mismatched brakets error
-class MismatchedBraketsException {};
+//The longest run of output operations written with a single bounds check
+#define MAX_OUTPUT_RUN 64
 
-//Callback functions used in code
-static void __fastcall outputCallback(int c)
+//The fewest cells a run of additions must change to be done with one vector add
+#define MIN_VECTOR_CELLS 4
+
+//Alignment of loop headers
+// Innermost loops are aligned further so small loops fit in one fetch block
+//  If more padding than MAX_LOOP_PADDING is needed, a smaller alignment is used
+#define LOOP_ALIGNMENT 16
+#define INNER_LOOP_ALIGNMENT 32
+#define MAX_LOOP_PADDING 10
+
+//Lazy compilation
+// Loops with more than LAZY_LOOP_SIZE operations are compiled when first
+// entered and the top level code is compiled LAZY_CHUNK_SIZE operations at a time
+#define LAZY_LOOP_SIZE 256
+#define LAZY_CHUNK_SIZE 4096
+
+//Register number meaning "no register"
+#define NO_REGISTER 0xFF
+
+//Largest pointer movement (in bytes) written without testing the pointer
+// Cells are accessed within BF_MAX_OFFSET cells of a tested pointer so
+// every access is less than BF_GUARD_SIZE from the tape.
+#define MAX_MOVE_SIZE (BF_GUARD_SIZE / 2)
+static_assert(MAX_MOVE_SIZE + BF_MAX_OFFSET * 8 + 32 <= BF_GUARD_SIZE, "Offsets can skip the guard regions");
+
+//Returns true if generating 64-bit code
+static bool is64Bit(CompilerState& out)
+{
+    return out.getArchitecture() == ARCH_X86_64;
+}
+
+//Writes a 32-bit instruction with a Runtime field operand
+// ([esi + field] or [r12 + field] in x86-64)
+//  rex = REX prefix to use in x86-64 (REX.B is added automatically)
+//  reg = register / opcode extension stored in the ModRM byte
+static void putRuntimeOp(CompilerState& out, uint8_t rex, uint8_t opcode, uint8_t reg, size_t field)
+{
+    //Every field the code uses is pointer sized, so scale the offset to the
+    // pointer size of the target in case it differs from this machine's
+    field = field / sizeof(void *) * (is64Bit(out) ? 8 : 4);
+
+    if(is64Bit(out))
+    {
+        out.put(0x41 | rex, opcode);
+        out.put(0x44 | (reg << 3), 0x24);       // [r12 + disp8]
+    }
+    else
+    {
+        out.put(opcode);
+        out.put(0x46 | (reg << 3));             // [esi + disp8]
+    }
+
+    out.put(static_cast<uint8_t>(field));
+}
+
+//Stores and loads the output position register to / from the runtime
+static void saveOutputPos(CompilerState& out)
+{
+    if(is64Bit(out))
+        putRuntimeOp(out, 0x4C, 0x89, 5, offsetof(Runtime, outputPos));   // mov [r12 + outputPos], r13
+    else
+        putRuntimeOp(out, 0, 0x89, 7, offsetof(Runtime, outputPos));      // mov [esi + outputPos], edi
+}
+
+static void loadOutputPos(CompilerState& out)
+{
+    if(is64Bit(out))
+        putRuntimeOp(out, 0x4C, 0x8B, 5, offsetof(Runtime, outputPos));   // mov r13, [r12 + outputPos]
+    else
+        putRuntimeOp(out, 0, 0x8B, 7, offsetof(Runtime, outputPos));      // mov edi, [esi + outputPos]
+}
+
+//Writes a call to a runtime function taking the Runtime as its argument
+// function = offset of the function pointer in the Runtime
+static void writeRuntimeCall(CompilerState& out, size_t function)
+{
+    saveOutputPos(out);
+
+    if(is64Bit(out))
+        out.put(0x4C, 0x89, 0xE7);      // mov rdi, r12
+    else
+        out.put(0x89, 0xF1);            // mov ecx, esi
+
+    putRuntimeOp(out, 0, 0xFF, 2, function);    // call [esi + function]
+    loadOutputPos(out);
+}
+
+//Writes the prolog for the program
+// The code is called with a pointer to the Runtime in ecx (rdi in x86-64)
+static void writeProlog(CompilerState& out)
+{
+    if(is64Bit(out))
+    {
+        out.put(0x55);                  // push rbp
+        out.put(0x48, 0x89, 0xE5);      // mov rbp, rsp
+        out.put(0x53);                  // push rbx
+        out.put(0x41, 0x54);            // push r12
+        out.put(0x41, 0x55);            // push r13
+        out.put(0x48, 0x83, 0xEC, 0x08);// sub rsp, 8 (align stack for calls)
+        out.put(0x49, 0x89, 0xFC);      // mov r12, rdi
+    }
+    else
+    {
+        out.put(0x55);			// push ebp
+        out.put(0x89, 0xE5);	// mov ebp, esp
+        out.put(0x53);			// push ebx
+        out.put(0x56);			// push esi
+        out.put(0x57);			// push edi
+        out.put(0x89, 0xCE);	// mov esi, ecx
+    }
+
+    putRuntimeOp(out, 0x08, 0x8B, 3, offsetof(Runtime, tape));    // mov ebx, [esi + tape]
+    loadOutputPos(out);
+}
+
+//Writes the epilog for the program
+// If flush is false, the output is left in the buffer for the caller
+static void writeEpilog(CompilerState& out, bool flush = true)
+{
+    //Write any remaining output
+    if(flush)
+        writeRuntimeCall(out, offsetof(Runtime, flushOutput));
+    else
+        saveOutputPos(out);
+
+    if(is64Bit(out))
+    {
+        out.put(0x48, 0x83, 0xC4, 0x08);// add rsp, 8
+        out.put(0x41, 0x5D);            // pop r13
+        out.put(0x41, 0x5C);            // pop r12
+    }
+    else
+    {
+        out.put(0x5F);      // pop edi
+        out.put(0x5E);      // pop esi
+    }
+
+    out.put(0x5B);          // pop ebx
+    out.put(0x5D);          // pop ebp
+    out.put(0xC3);          // ret
+}
+
+//Writes the ModRM byte and displacement addressing the cell at the given offset
+// reg = register / opcode extension stored in the ModRM byte
+static void putCellOperand(CompilerState& out, uint8_t reg, int32_t offset)
+{
+    int32_t disp = offset * out.getCellSize();
+
+    if(disp == 0)
+    {
+        out.put(0x03 | (reg << 3));             // [ebx]
+    }
+    else if(disp == static_cast<int8_t>(disp))
+    {
+        out.put(0x43 | (reg << 3));             // [ebx + disp8]
+        out.put(static_cast<uint8_t>(disp));
+    }
+    else
+    {
+        out.put(0x83 | (reg << 3));             // [ebx + disp32]
+        out.putInt(disp);
+    }
+}
+
+//Writes the REX prefix needed to use the given registers (if any)
+// reg  = register stored in the reg field of the ModRM byte
+// rm   = register stored in the rm field (or NO_REGISTER)
+// wide = true for a 64-bit operand size
+static void putRex(CompilerState& out, uint8_t reg, uint8_t rm, bool wide = false)
+{
+    uint8_t rex = (reg & 8) >> 1;
+
+    if(rm != NO_REGISTER)
+        rex |= (rm & 8) >> 3;
+
+    if(wide)
+        rex |= 8;
+
+    if(rex != 0)
+        out.put(0x40 | rex);
+}
+
+//Writes an instruction with a cell operand
+// opcode8 is used for byte cells and opcode for larger cells
+//  cellReg = register holding the cell (NO_REGISTER to use the tape)
+static void putCellOp(CompilerState& out, uint8_t opcode8, uint8_t opcode,
+                      uint8_t reg, int32_t offset, uint8_t cellReg = NO_REGISTER)
+{
+    if(out.getCellSize() == 2)
+        out.put(0x66);                          // Operand size prefix
+
+    putRex(out, reg, cellReg, out.getCellSize() == 8);
+    out.put(out.getCellSize() == 1 ? opcode8 : opcode);
+
+    if(cellReg != NO_REGISTER)
+        out.put(0xC0 | ((reg & 7) << 3) | (cellReg & 7));
+    else
+        putCellOperand(out, reg & 7, offset);
+}
+
+//Writes an immediate value the size of a cell
+// (qword cells use a sign extended dword)
+static void putCellImmediate(CompilerState& out, int32_t value)
+{
+    if(out.getCellSize() == 1)
+        out.put(static_cast<uint8_t>(value));
+    else if(out.getCellSize() == 2)
+        out.putShort(static_cast<uint16_t>(value));
+    else
+        out.putInt(value);
+}
+
+//Writes an arithmetic instruction with a cell and immediate operand
+// ext = opcode extension of the instruction (0 = add, 5 = sub, 7 = cmp)
+static void putCellArithmetic(CompilerState& out, uint8_t ext, int32_t offset, int32_t value,
+                              uint8_t cellReg = NO_REGISTER)
+{
+    if(out.getCellSize() != 1 && value == static_cast<int8_t>(value))
+    {
+        //Sign extended byte
+        putCellOp(out, 0x83, 0x83, ext, offset, cellReg);   // <op> [ebx + offset], byte <value>
+        out.put(static_cast<uint8_t>(value));
+    }
+    else
+    {
+        putCellOp(out, 0x80, 0x81, ext, offset, cellReg);   // <op> [ebx + offset], <value>
+        putCellImmediate(out, value);
+    }
+}
+
+//Loads the cell at the given offset into a register (zero extended)
+//  cellReg = register holding the cell (NO_REGISTER to use the tape)
+static void loadCell(CompilerState& out, uint8_t reg, int32_t offset, uint8_t cellReg = NO_REGISTER)
+{
+    putRex(out, reg, cellReg, out.getCellSize() == 8);
+
+    if(out.getCellSize() == 1)
+        out.put(0x0F, 0xB6);                    // movzx reg, byte [ebx + offset]
+    else if(out.getCellSize() == 2)
+        out.put(0x0F, 0xB7);                    // movzx reg, word [ebx + offset]
+    else
+        out.put(0x8B);                          // mov reg, [ebx + offset] (rax for qword cells)
+
+    if(cellReg != NO_REGISTER)
+        out.put(0xC0 | ((reg & 7) << 3) | (cellReg & 7));
+    else
+        putCellOperand(out, reg & 7, offset);
+}
+
+//Pushes or pops a register (the full 32 or 64-bit register)
+static void writePush(CompilerState& out, uint8_t reg)
+{
+    putRex(out, 0, reg);
+    out.put(0x50 | (reg & 7));                  // push reg
+}
+
+static void writePop(CompilerState& out, uint8_t reg)
+{
+    putRex(out, 0, reg);
+    out.put(0x58 | (reg & 7));                  // pop reg
+}
+
+//Writes an instruction reading the current cell
+// Used after moving the pointer so leaving the tape faults in a guard region
+static void writeProbe(CompilerState& out)
+{
+    out.put(0x84, 0x1B);                // test [ebx], bl
+}
+
+//Writes an instruction moving the pointer by the given number of bytes
+static void writeMoveBytes(CompilerState& out, int32_t byteInc)
+{
+    bool x64 = is64Bit(out);
+
+    //Pointer operations use the 64-bit register in x86-64
+    if(x64)
+        out.put(0x48);                          // REX.W
+
+    if(byteInc == 1)
+    {
+        if(x64)
+            out.put(0xFF, 0xC3);                // inc rbx
+        else
+            out.put(0x43);                      // inc ebx
+    }
+    else if(byteInc == -1)
+    {
+        if(x64)
+            out.put(0xFF, 0xCB);                // dec rbx
+        else
+            out.put(0x4B);                      // dec ebx
+    }
+    else if(byteInc == static_cast<int8_t>(byteInc))   // Sign-Extended
+    {
+        out.put(0x83, 0xC3);                    // add ebx, byte <byteInc>
+        out.put(static_cast<uint8_t>(byteInc));
+    }
+    else
+    {
+        out.put(0x81, 0xC3);                    // add ebx, dword <byteInc>
+        out.putInt(byteInc);
+    }
+}
+
+//Writes instructions moving the pointer by the given number of cells
+// Movements larger than MAX_MOVE_SIZE are split with the pointer tested
+// between each part so they can't skip over a guard region. The pointer is
+// not tested at the end.
+static void writeMove(CompilerState& out, int32_t cells)
+{
+    int64_t byteInc = static_cast<int64_t>(cells) * out.getCellSize();
+
+    while(byteInc > MAX_MOVE_SIZE || byteInc < -MAX_MOVE_SIZE)
+    {
+        int32_t step = byteInc > 0 ? MAX_MOVE_SIZE : -MAX_MOVE_SIZE;
+        writeMoveBytes(out, step);
+        writeProbe(out);
+        byteInc -= step;
+    }
+
+    if(byteInc != 0)
+        writeMoveBytes(out, static_cast<int32_t>(byteInc));
+}
+
+//Writes a jump over the following code to be fixed up by fixShortJump
+// Returns the position to pass to fixShortJump
+static uint32_t writeShortJump(CompilerState& out, uint8_t opcode)
+{
+    out.put(opcode, 0x00);              // j<cc> short <location>
+    return out.getPosition();
+}
+
+//Fixes up a jump written by writeShortJump to point to the current position
+static void fixShortJump(CompilerState& out, uint32_t position)
+{
+    out.putAt(position - 1, static_cast<uint8_t>(out.getPosition() - position));
+}
+
+//Writes a short jump back to the given position
+static void writeShortJumpBack(CompilerState& out, uint8_t opcode, uint32_t target)
+{
+    out.put(opcode, static_cast<uint8_t>(target - out.getPosition() - 2));
+}
+
+//Writes nops until the position is a multiple of alignment
+// The alignment is halved until at most maxPadding nops are needed
+static void writePadding(CompilerState& out, uint32_t alignment, uint32_t maxPadding)
+{
+    //Recommended multi-byte nops (1 to 9 bytes)
+    static uint8_t const nops[9][9] =
+    {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0F, 0x1F, 0x00 },
+        { 0x0F, 0x1F, 0x40, 0x00 },
+        { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+
+    uint32_t padding = (0 - out.getPosition()) & (alignment - 1);
+    while(padding > maxPadding)
+    {
+        alignment /= 2;
+        padding = (0 - out.getPosition()) & (alignment - 1);
+    }
+
+    while(padding > 0)
+    {
+        uint32_t size = padding < 9 ? padding : 9;
+
+        for(uint32_t i = 0; i < size; i++)
+            out.put(nops[size - 1][i]);
+
+        padding -= size;
+    }
+}
+
+//Writes an increment of a 64-bit profile counter (see bf::Profile)
+// Uses eax and changes the flags
+static void writeCounterIncrement(CompilerState& out, int32_t counter)
+{
+    putRuntimeOp(out, 0x08, 0x8B, 0, offsetof(Runtime, profileCounters));   // mov eax, [esi + profileCounters]
+
+    if(is64Bit(out))
+    {
+        out.put(0x48, 0x83, 0x80);      // add qword [rax + counter], 1
+        out.putInt(counter * 8);
+        out.put(1);
+    }
+    else
+    {
+        out.put(0x83, 0x80);            // add dword [eax + counter], 1
+        out.putInt(counter * 8);
+        out.put(1);
+        out.put(0x83, 0x90);            // adc dword [eax + counter + 4], 0
+        out.putInt(counter * 8 + 4);
+        out.put(0);
+    }
+}
+
+//Writes the start of a loop which is skipped if the current cell is zero
+// The loop stack is given the position of the jump over the loop and the
+// position of the loop header
+//  longJump  = use a near jump to skip the loop (instead of a short jump)
+//  testCell  = false if the zero flag already reflects the current cell
+//  alignment = alignment of the loop header
+//  counter   = profile counter incremented when the loop is entered (-1 for none)
+static void writeLoopBegin(CompilerState& out, bool longJump, bool testCell, uint32_t alignment,
+                           int32_t counter = -1)
+{
+    if(testCell)
+        putCellArithmetic(out, 7, 0, 0);  // cmp [ebx], 0
+
+    if(longJump)
+    {
+        out.put(0x0F, 0x84);            // jz near <end>
+        out.putInt(0);
+        out.loopStack().push(out.getPosition());
+    }
+    else
+    {
+        out.loopStack().push(writeShortJump(out, 0x74));   // jz short <end>
+    }
+
+    if(counter >= 0)
+        writeCounterIncrement(out, counter);
+
+    writePadding(out, alignment, MAX_LOOP_PADDING);
+    out.loopStack().push(out.getPosition());
+}
+
+//Restores the registers saved by the prolog and returns
+// This can be used anywhere in the code since the stack is reset from ebp.
+static void writeReturn(CompilerState& out)
+{
+    if(is64Bit(out))
+    {
+        out.put(0x48, 0x8D, 0x65, 0xE8);// lea rsp, [rbp - 24]
+        out.put(0x41, 0x5D);            // pop r13
+        out.put(0x41, 0x5C);            // pop r12
+    }
+    else
+    {
+        out.put(0x8D, 0x65, 0xF4);      // lea esp, [ebp - 12]
+        out.put(0x5F);                  // pop edi
+        out.put(0x5E);                  // pop esi
+    }
+
+    out.put(0x5B);                      // pop ebx
+    out.put(0x5D);                      // pop ebp
+    out.put(0xC3);                      // ret
+}
+
+//Writes a check of the step budget at a loop header
+// The budget is decremented every iteration and checkBudget is called when it
+// runs out. If checkBudget returns 0, the pointer and the address of the
+// header are saved in the runtime and the program returns straight away, so
+// it can be continued later (the register cache must be empty).
+static void writeBudgetCheck(CompilerState& out)
+{
+    putRuntimeOp(out, 0x08, 0x83, 5, offsetof(Runtime, budget));  // sub [esi + budget], 1
+    out.put(1);
+    uint32_t notEmpty = writeShortJump(out, 0x75);                  // jnz short <continue>
+
+    writeRuntimeCall(out, offsetof(Runtime, checkBudget));
+    out.put(0x85, 0xC0);                // test eax, eax
+    uint32_t resume = writeShortJump(out, 0x75);                    // jnz short <continue>
+
+    //Save where to continue from
+    putRuntimeOp(out, 0x08, 0x89, 3, offsetof(Runtime, tape));    // mov [esi + tape], ebx
+
+    uint32_t address;
+    uint32_t base = 0;
+
+    if(is64Bit(out))
+    {
+        out.put(0x48, 0x8D, 0x05);      // lea rax, [rip + <continue>]
+        address = out.getPosition();
+        out.putInt(0);
+    }
+    else
+    {
+        //The code has no absolute addresses so get the address from the stack
+        out.put(0xE8);                  // call <next>
+        out.putInt(0);
+        base = out.getPosition();
+        out.put(0x58);                  // pop eax
+        out.put(0x05);                  // add eax, <continue> - <next>
+        address = out.getPosition();
+        out.putInt(0);
+    }
+
+    putRuntimeOp(out, 0x08, 0x89, 0, offsetof(Runtime, resume));  // mov [esi + resume], eax
+    writeReturn(out);
+
+    fixShortJump(out, notEmpty);
+    fixShortJump(out, resume);
+
+    if(is64Bit(out))
+        out.putRelativeAt(address, out.getPosition());
+    else
+        out.putIntAt(address, out.getPosition() - base);
+}
+
+//Writes the end of a loop started by writeLoopBegin
+// Returns false if the loop used a short jump and is too large for it
+static bool writeLoopEnd(CompilerState& out, bool longJump, bool testCell)
+{
+    uint32_t header = out.loopStack().top();
+    out.loopStack().pop();
+    uint32_t fixup = out.loopStack().top();
+    out.loopStack().pop();
+
+    if(testCell)
+        putCellArithmetic(out, 7, 0, 0);  // cmp [ebx], 0
+
+    //Jump back to the header
+    if(static_cast<int32_t>(header - out.getPosition() - 2) >= -128)
+    {
+        writeShortJumpBack(out, 0x75, header);     // jnz short <header>
+    }
+    else
+    {
+        out.put(0x0F, 0x85);            // jnz near <header>
+        out.putRelative(header);
+    }
+
+    //Fix the jump over the loop
+    if(longJump)
+    {
+        out.putRelativeAt(fixup - 4, out.getPosition());
+    }
+    else
+    {
+        if(out.getPosition() - fixup > 127)
+            return false;
+
+        fixShortJump(out, fixup);
+    }
+
+    return true;
+}
+
+//Writes a vector instruction operating on xmm / ymm registers
+// The instruction must be an SSE2 instruction with the 66 prefix in the 0F map
+static void writeVectorOp(CompilerState& out, uint8_t opcode, uint8_t modRm, uint8_t vvvv = 0)
+{
+    if(out.getVectorExtension() == VECTOR_AVX2)
+        out.put(0xC5, 0x85 | ((~vvvv & 0xF) << 3));   // VEX.256.66.0F
+    else
+        out.put(0x66, 0x0F);
+
+    out.put(opcode, modRm);
+}
+
+//Writes a loop moving the pointer by the given number of cells until
+// the current cell is zero
+static void writeScan(CompilerState& out, int32_t stride)
+{
+    uint32_t cellSize = out.getCellSize();
+    uint64_t stepSize = static_cast<uint64_t>(stride < 0 ? -static_cast<int64_t>(stride) : stride) * cellSize;
+    uint32_t blockSize = out.getVectorExtension() == VECTOR_AVX2 ? 32 : 16;
+    bool x64 = is64Bit(out);
+
+    //Use a scalar loop if the vector code can't be used
+    // (comparing qwords needs SSE4.1)
+    if(out.getVectorExtension() == VECTOR_NONE || stepSize > blockSize ||
+        (stepSize & (stepSize - 1)) != 0 || cellSize == 8)
+    {
+        //Large strides are split by writeMove and need near jumps
+        bool nearJumps = stepSize > MAX_MOVE_SIZE;
+        uint32_t testFixup;
+
+        if(nearJumps)
+        {
+            out.put(0xE9);                              // jmp near <test>
+            testFixup = out.getPosition();
+            out.putInt(0);
+        }
+        else
+        {
+            testFixup = writeShortJump(out, 0xEB);      // jmp <test>
+        }
+
+        uint32_t loopStart = out.getPosition();
+        writeMove(out, stride);
+
+        if(nearJumps)
+            out.putRelativeAt(testFixup, out.getPosition());
+        else
+            fixShortJump(out, testFixup);
+
+        putCellArithmetic(out, 7, 0, 0);  // cmp [ebx], 0
+
+        if(nearJumps)
+        {
+            out.put(0x0F, 0x85);                        // jnz near <loopStart>
+            out.putRelative(loopStart);
+        }
+        else
+        {
+            writeShortJumpBack(out, 0x75, loopStart);   // jnz <loopStart>
+        }
+        return;
+    }
+
+    //The tape is searched one aligned block at a time so loads never cross
+    // into pages outside the tape. A mask selects the bytes in each block
+    // which are the start of a cell visited by the loop.
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < blockSize; i += stepSize)
+        mask |= 1u << i;
+
+    //Comparison instruction for the cell size
+    uint8_t compareOp = cellSize == 1 ? 0x74 : (cellSize == 2 ? 0x75 : 0x76);
+
+    out.put(0x89, 0xD9);                // mov ecx, ebx
+    out.put(0x83, 0xE1);                // and ecx, <blockSize - 1>
+    out.put(static_cast<uint8_t>(blockSize - 1));
+
+    if(x64)
+        out.put(0x48);                  // REX.W
+    out.put(0x83, 0xE3);                // and ebx, -<blockSize>
+    out.put(static_cast<uint8_t>(-static_cast<int32_t>(blockSize)));
+
+    //Rotate mask so it starts at the position of the current cell
+    out.put(0xBA);                      // mov edx, <mask>
+    out.putInt(mask);
+    if(blockSize == 16)
+        out.put(0x66);                  // (rotate 16 bits)
+    out.put(0xD3, 0xC2);                // rol edx, cl
+
+    if(stride < 0)
+        out.put(0x83, 0xF1, 0x1F);      // xor ecx, 31 (ecx = 31 - ecx)
+
+    //Test the first block, ignoring cells on the wrong side of the pointer
+    writeVectorOp(out, 0xEF, 0xC9, 1);  // pxor xmm1, xmm1
+    writeVectorOp(out, 0x6F, 0x03);     // movdqa xmm0, [ebx]
+    writeVectorOp(out, compareOp, 0xC1);// pcmpeq xmm0, xmm1
+    writeVectorOp(out, 0xD7, 0xC0);     // pmovmskb eax, xmm0
+    out.put(0x21, 0xD0);                // and eax, edx
+
+    if(stride > 0)
+    {
+        out.put(0xD3, 0xE8);            // shr eax, cl
+        out.put(0xD3, 0xE0);            // shl eax, cl
+    }
+    else
+    {
+        out.put(0xD3, 0xE0);            // shl eax, cl
+        out.put(0xD3, 0xE8);            // shr eax, cl
+    }
+
+    uint32_t foundFixup = writeShortJump(out, 0x75);   // jnz <found>
+
+    //Test the following blocks
+    uint32_t loopStart = out.getPosition();
+
+    if(x64)
+        out.put(0x48);                  // REX.W
+    out.put(0x83, stride > 0 ? 0xC3 : 0xEB);    // add / sub ebx, <blockSize>
+    out.put(static_cast<uint8_t>(blockSize));
+
+    writeVectorOp(out, 0x6F, 0x03);     // movdqa xmm0, [ebx]
+    writeVectorOp(out, compareOp, 0xC1);// pcmpeq xmm0, xmm1
+    writeVectorOp(out, 0xD7, 0xC0);     // pmovmskb eax, xmm0
+    out.put(0x21, 0xD0);                // and eax, edx
+    writeShortJumpBack(out, 0x74, loopStart);  // jz <loopStart>
+
+    //Move to the cell found
+    fixShortJump(out, foundFixup);
+    out.put(0x0F, stride > 0 ? 0xBC : 0xBD);   // bsf / bsr eax, eax
+    out.put(0xC0);
+
+    if(x64)
+        out.put(0x48);                  // REX.W
+    out.put(0x01, 0xC3);                // add ebx, eax
+
+    if(out.getVectorExtension() == VECTOR_AVX2)
+        out.put(0xC5, 0xF8, 0x77);      // vzeroupper
+}
+
+//Writes instructions loading a 64-bit constant into the low half of an xmm
+// register (the rest of the register is cleared)
+//  temp = xmm register which may be overwritten
+static void writeVectorQword(CompilerState& out, uint8_t reg, uint8_t temp, uint64_t value)
 {
-    cout.put(static_cast<char>(c));
+    uint32_t high = static_cast<uint32_t>(value >> 32);
+
+    if(value == 0)
+    {
+        out.put(0x66, 0x0F, 0xEF, 0xC0 | (reg << 3) | reg);    // pxor xmm<reg>, xmm<reg>
+    }
+    else if(is64Bit(out) && high != 0)
+    {
+        out.put(0x48, 0xB8);            // mov rax, <value>
+        out.putLong(value);
+        out.put(0x66, 0x48, 0x0F, 0x6E);// movq xmm<reg>, rax
+        out.put(0xC0 | (reg << 3));
+    }
+    else
+    {
+        out.put(0xB8);                  // mov eax, <low>
+        out.putInt(static_cast<uint32_t>(value));
+        out.put(0x66, 0x0F, 0x6E, 0xC0 | (reg << 3));          // movd xmm<reg>, eax
+
+        if(high != 0)
+        {
+            out.put(0xB8);              // mov eax, <high>
+            out.putInt(high);
+            out.put(0x66, 0x0F, 0x6E, 0xC0 | (temp << 3));     // movd xmm<temp>, eax
+            out.put(0x66, 0x0F, 0x62, 0xC0 | (reg << 3) | temp);   // punpckldq xmm<reg>, xmm<temp>
+        }
+    }
+}
+
+//Writes a vector add of the given constant to the 16 or 32 bytes of the tape
+// starting at the cell at offset
+// The constant is built in registers so the code still has no addresses.
+static void writeVectorAdd(CompilerState& out, vector<uint8_t> const& constant, int32_t offset)
+{
+    uint64_t qwords[4] = { 0, 0, 0, 0 };
+    for(size_t i = 0; i < constant.size(); i++)
+        qwords[i / 8] |= static_cast<uint64_t>(constant[i]) << (i % 8 * 8);
+
+    //Add instruction for the cell size
+    static uint8_t const addOps[9] = { 0, 0xFC, 0xFD, 0, 0xFE, 0, 0, 0, 0xD4 };
+    uint8_t addOp = addOps[out.getCellSize()];
+
+    //Build the constant in xmm1 (or ymm1)
+    writeVectorQword(out, 1, 3, qwords[0]);
+    if(qwords[1] != 0)
+    {
+        writeVectorQword(out, 2, 3, qwords[1]);
+        out.put(0x66, 0x0F, 0x6C, 0xCA);            // punpcklqdq xmm1, xmm2
+    }
+
+    if(constant.size() == 32)
+    {
+        writeVectorQword(out, 2, 3, qwords[2]);
+        if(qwords[3] != 0)
+        {
+            writeVectorQword(out, 4, 3, qwords[3]);
+            out.put(0x66, 0x0F, 0x6C, 0xD4);        // punpcklqdq xmm2, xmm4
+        }
+
+        out.put(0xC4, 0xE3, 0x75, 0x38);            // vinserti128 ymm1, ymm1, xmm2, 1
+        out.put(0xCA, 0x01);
+
+        out.put(0xC5, 0xFE, 0x6F);                  // vmovdqu ymm0, [ebx + offset]
+        putCellOperand(out, 0, offset);
+        out.put(0xC5, 0xFD, addOp, 0xC1);           // vpadd<b/w/d/q> ymm0, ymm0, ymm1
+        out.put(0xC5, 0xFE, 0x7F);                  // vmovdqu [ebx + offset], ymm0
+        putCellOperand(out, 0, offset);
+        out.put(0xC5, 0xF8, 0x77);                  // vzeroupper
+    }
+    else
+    {
+        out.put(0xF3, 0x0F, 0x6F);                  // movdqu xmm0, [ebx + offset]
+        putCellOperand(out, 0, offset);
+        out.put(0x66, 0x0F, addOp, 0xC1);           // padd<b/w/d/q> xmm0, xmm1
+        out.put(0xF3, 0x0F, 0x7F);                  // movdqu [ebx + offset], xmm0
+        putCellOperand(out, 0, offset);
+    }
+}
+
+//Keeps the values of cells in registers across straight-line code
+// A block is the code between operations which move the pointer, branch or
+// call the runtime. Cells used more than once in a block are loaded into a
+// register on first use and written back when the block ends.
+class RegisterCache
+{
+private:
+    struct Entry
+    {
+        int32_t offset;
+        uint8_t reg;
+        bool dirty;
+    };
+
+    // Cells currently held in registers
+    vector<Entry> entries_;
+
+    // Registers not holding a cell
+    vector<uint8_t> free_;
+
+    // Number of uses of each cell left in the block
+    map<int32_t, uint32_t> uses_;
+
+public:
+    //Returns true if the operation ends a block
+    static bool endsBlock(ir::OpType type)
+    {
+        return type == ir::OP_MOVE || type == ir::OP_SCAN || type == ir::OP_INPUT ||
+            type == ir::OP_LOOP_BEGIN || type == ir::OP_LOOP_END;
+    }
+
+    //Starts the block beginning at the given operation
+    // Every register must have been written back with flush
+    //  end = operation after the last one being written
+    void begin(CompilerState& out, ir::Program const& program, uint32_t start, uint32_t end)
+    {
+        //Registers not used by anything else (rcx, rdx, r8 - r11 in x86-64)
+        // These are all caller saved so they must be preserved around calls
+        free_.clear();
+        free_.push_back(1);
+        free_.push_back(2);
+
+        if(is64Bit(out))
+        {
+            for(uint8_t reg = 8; reg <= 11; reg++)
+                free_.push_back(reg);
+        }
+
+        //Count the uses of each cell
+        uses_.clear();
+
+        for(uint32_t i = start; i < end && !endsBlock(program[i].type); i++)
+        {
+            uses_[program[i].offset]++;
+
+            if(program[i].type == ir::OP_MUL)
+                uses_[program[i].srcOffset]++;
+        }
+    }
+
+    //Gets the register holding the cell at the given offset
+    // If the cell is used again later in the block and allocate is true, a
+    // register is allocated for it (loading the cell unless it is about to
+    // be overwritten). Code which may be skipped must not allocate registers.
+    //  Returns NO_REGISTER if the tape should be used instead
+    uint8_t use(CompilerState& out, int32_t offset, bool read, bool write, bool allocate = true)
+    {
+        uint32_t remaining = --uses_[offset];
+
+        for(size_t i = 0; i < entries_.size(); i++)
+        {
+            if(entries_[i].offset == offset)
+            {
+                entries_[i].dirty |= write;
+                return entries_[i].reg;
+            }
+        }
+
+        //Not worth a register if this is the last use
+        if(remaining == 0 || free_.empty() || !allocate)
+            return NO_REGISTER;
+
+        Entry entry = { offset, free_.back(), write };
+        free_.pop_back();
+        entries_.push_back(entry);
+
+        if(read)
+            loadCell(out, entry.reg, offset);   // movzx reg, [ebx + offset]
+
+        return entry.reg;
+    }
+
+    //Writes every modified cell back to the tape and empties the cache
+    // Only mov instructions are used so the flags are preserved
+    //  Returns the register which held the current cell (or NO_REGISTER)
+    uint8_t flush(CompilerState& out)
+    {
+        uint8_t currentReg = NO_REGISTER;
+
+        for(size_t i = 0; i < entries_.size(); i++)
+        {
+            if(entries_[i].dirty)   // mov [ebx + offset], reg
+                putCellOp(out, 0x88, 0x89, entries_[i].reg, entries_[i].offset);
+
+            if(entries_[i].offset == 0)
+                currentReg = entries_[i].reg;
+        }
+
+        entries_.clear();
+        return currentReg;
+    }
+
+    //Returns true if the cell at the given offset is held in a register
+    bool holds(int32_t offset) const
+    {
+        for(size_t i = 0; i < entries_.size(); i++)
+        {
+            if(entries_[i].offset == offset)
+                return true;
+        }
+
+        return false;
+    }
+
+    //Records a use of a cell which is written to the tape without the cache
+    // (the cell must not be held in a register)
+    void skip(int32_t offset)
+    {
+        uses_[offset]--;
+    }
+
+    //Saves and restores the registers in use around a runtime call
+    // An even number of registers is pushed to keep the stack aligned
+    void save(CompilerState& out) const
+    {
+        if(entries_.size() % 2 != 0)
+            writePush(out, entries_[0].reg);
+
+        for(size_t i = 0; i < entries_.size(); i++)
+            writePush(out, entries_[i].reg);
+    }
+
+    void restore(CompilerState& out) const
+    {
+        for(size_t i = entries_.size(); i > 0; i--)
+            writePop(out, entries_[i - 1].reg);
+
+        if(entries_.size() % 2 != 0)
+            writePop(out, entries_[0].reg);
+    }
+};
+
+//Writes a run of output operations to the output buffer
+static void writeOutput(CompilerState& out, RegisterCache& cache, ir::Op const * ops, uint32_t count)
+{
+    bool x64 = is64Bit(out);
+
+    //Flush the buffer if there isn't space for everything
+    if(x64)
+        out.put(0x49, 0x8D, 0x45);      // lea rax, [r13 + <count>]
+    else
+        out.put(0x8D, 0x47);            // lea eax, [edi + <count>]
+    out.put(static_cast<uint8_t>(count));
+
+    putRuntimeOp(out, 0x08, 0x3B, 0, offsetof(Runtime, outputEnd));  // cmp eax, [esi + outputEnd]
+    uint32_t skipFixup = writeShortJump(out, 0x76);                   // jbe <skip>
+    cache.save(out);
+    writeRuntimeCall(out, offsetof(Runtime, flushOutput));
+    cache.restore(out);
+    fixShortJump(out, skipFixup);
+
+    //Copy the low byte of each cell
+    for(uint32_t i = 0; i < count; i++)
+    {
+        uint8_t cellReg = cache.use(out, ops[i].offset, true, false);
+
+        if(i == 0 || ops[i].offset != ops[i - 1].offset)
+        {
+            if(cellReg != NO_REGISTER)
+            {
+                putRex(out, cellReg, NO_REGISTER);
+                out.put(0x88, 0xC0 | ((cellReg & 7) << 3));     // mov al, reg
+            }
+            else
+            {
+                out.put(0x8A);          // mov al, [ebx + offset]
+                putCellOperand(out, 0, ops[i].offset);
+            }
+        }
+
+        if(x64)
+            out.put(0x41, 0x88, 0x45);  // mov [r13 + i], al
+        else
+            out.put(0x88, 0x47);        // mov [edi + i], al
+        out.put(static_cast<uint8_t>(i));
+    }
+
+    if(x64)
+        out.put(0x49, 0x83, 0xC5);      // add r13, <count>
+    else
+        out.put(0x83, 0xC7);            // add edi, <count>
+    out.put(static_cast<uint8_t>(count));
 }
 
-static int __fastcall inputCallback(int eofCode)
+//Finds the run of additions starting at begin which can be done with one
+// vector add
+// The cells must fit in one vector and not be held in registers.
+//  Returns the number of operations in the run (0 if it isn't worth it)
+static uint32_t findVectorRun(CompilerState& out, RegisterCache const& cache,
+                              ir::Program const& program, uint32_t begin, uint32_t end)
 {
-    int result = cin.get();
+    if(out.getVectorExtension() == VECTOR_NONE)
+        return 0;
 
-    //Patch eofCode
-    if(cin.eof())
-        result = eofCode;
+    int64_t maxCells = (out.getVectorExtension() == VECTOR_AVX2 ? 32 : 16) / out.getCellSize();
+    int32_t low = program[begin].offset;
+    int32_t high = low;
+    vector<int32_t> cells;
 
-    return result;
-}
+    uint32_t i;
+    for(i = begin; i < end && program[i].type == ir::OP_ADD && !cache.holds(program[i].offset); i++)
+    {
+        int32_t offset = program[i].offset;
+        if(static_cast<int64_t>(max(high, offset)) - min(low, offset) >= maxCells)
+            break;
 
-//Writes the prolog for the program
-static void writeProlog(CompilerState& out)
-{
-    out.put(0x55);			// push ebp
-    out.put(0x89, 0xE5);	// mov ebp, esp
-    out.put(0x53);			// push ebx
-    out.put(0xBB);			// mov ebx, <heap>
-    out.putInt(reinterpret_cast<int32_t>(out.getHeap()));
+        low = min(low, offset);
+        high = max(high, offset);
+
+        if(find(cells.begin(), cells.end(), offset) == cells.end())
+            cells.push_back(offset);
+    }
+
+    return cells.size() >= MIN_VECTOR_CELLS ? i - begin : 0;
 }
 
-//Writes the epilog for the program
-static void writeEpilog(CompilerState& out)
+//Writes a run of additions found by findVectorRun
+// The vector starts at the lowest cell, so it may also read and write back
+// (unchanged) cells after the run.
+static void writeVectorRun(CompilerState& out, RegisterCache& cache, ir::Op const * ops, uint32_t count)
 {
-    out.put(0x5B);          // pop ebx
-    out.put(0x5D);          // pop ebp
-    out.put(0xC3);          // ret
+    uint32_t cellSize = out.getCellSize();
+    int32_t low = ops[0].offset;
+    int32_t high = low;
+
+    for(uint32_t i = 1; i < count; i++)
+    {
+        low = min(low, ops[i].offset);
+        high = max(high, ops[i].offset);
+    }
+
+    //Sum the value added to each cell
+    vector<uint64_t> values((high - low) + 1, 0);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        cache.skip(ops[i].offset);
+        values[ops[i].offset - low] += static_cast<uint64_t>(static_cast<int64_t>(ops[i].value));
+    }
+
+    //Store them in the vector as cells (little endian)
+    vector<uint8_t> constant(values.size() * cellSize <= 16 ? 16 : 32, 0);
+    for(size_t i = 0; i < values.size(); i++)
+    {
+        for(uint32_t j = 0; j < cellSize; j++)
+            constant[i * cellSize + j] = static_cast<uint8_t>(values[i] >> (j * 8));
+    }
+
+    writeVectorAdd(out, constant, low);
 }
 
-//Processes the given character
-static void processChar(CompilerState& out, int c, uint32_t number = 1)
+//Writes a run of multiplications of the same source cell
+// The targets are only changed if the source cell is not zero, since the
+// loop they came from would not have run (and the targets may be outside
+// the tape). The cache is not allowed to load any cells in this code.
+static void writeMultiply(CompilerState& out, RegisterCache& cache, ir::Op const * ops, uint32_t count)
 {
-    uint32_t cellSize = out.getCellSize();
-    uint32_t byteInc = number * cellSize;
+    uint8_t srcReg = cache.use(out, ops[0].srcOffset, true, false);
+    loadCell(out, 0, ops[0].srcOffset, srcReg);     // movzx eax, [ebx + srcOffset]
 
-    //Ignore "no times"
-    if(number == 0)
-        return;
+    if(out.getCellSize() == 8)
+        out.put(0x48);                  // REX.W
+    out.put(0x85, 0xC0);                // test eax, eax
+    out.put(0x0F, 0x84);                // jz <skip>
+    uint32_t skipFixup = out.getPosition();
+    out.putInt(0);
 
-    //What is it?
-    switch(c)
+    for(uint32_t i = 0; i < count; i++)
     {
-    case '+':
-        //Only 1?
-        if(number == 1)
+        ir::Op const& op = ops[i];
+
+        //Multiply source cell
+        if(i != 0)
+            loadCell(out, 0, op.srcOffset, cache.use(out, op.srcOffset, true, false, false));
+
+        if(op.value != 1 && op.value != -1)
         {
-            //Insert an increment
-            if(cellSize == 1)
-                out.put(0xFE, 0x03);        // inc byte [ebx]
-            else if(cellSize == 2)
-                out.put(0x66, 0xFF, 0x03);  // inc word [ebx]
+            if(out.getCellSize() == 8)
+                out.put(0x48);                  // REX.W
+
+            if(op.value == static_cast<int8_t>(op.value))
+            {
+                out.put(0x6B, 0xC0);            // imul eax, eax, byte <value>
+                out.put(static_cast<uint8_t>(op.value));
+            }
             else
-                out.put(0xFF, 0x03);        // inc dword [ebx]
+            {
+                out.put(0x69, 0xC0);            // imul eax, eax, <value>
+                out.putInt(op.value);
+            }
         }
+
+        //Add (or subtract) it from the target
+        uint8_t cellReg = cache.use(out, op.offset, true, true, false);
+
+        if(op.value == -1)
+            putCellOp(out, 0x28, 0x29, 0, op.offset, cellReg);     // sub [ebx + offset], eax
         else
+            putCellOp(out, 0x00, 0x01, 0, op.offset, cellReg);     // add [ebx + offset], eax
+    }
+
+    out.putRelativeAt(skipFixup, out.getPosition());
+}
+
+//Processes the given operation
+static void processOp(CompilerState& out, RegisterCache& cache, ir::Op const& op)
+{
+    switch(op.type)
+    {
+    case ir::OP_ADD:
+        {
+            uint8_t cellReg = cache.use(out, op.offset, true, true);
+
+            if(op.value == 1)
+                putCellOp(out, 0xFE, 0xFF, 0, op.offset, cellReg);     // inc [ebx + offset]
+            else if(op.value == -1)
+                putCellOp(out, 0xFE, 0xFF, 1, op.offset, cellReg);     // dec [ebx + offset]
+            else if(op.value > 0)
+                putCellArithmetic(out, 0, op.offset, op.value, cellReg);    // add [ebx + offset], <value>
+            else
+                putCellArithmetic(out, 5, op.offset, -op.value, cellReg);   // sub [ebx + offset], <value>
+            break;
+        }
+
+    case ir::OP_SET:
         {
-            //Insert an add
-            if(cellSize == 1)
+            uint8_t cellReg = cache.use(out, op.offset, false, true);
+
+            if(cellReg != NO_REGISTER && out.getCellSize() == 8)
             {
-                out.put(0x80, 0x03);        // add byte [ebx], <number>
-                out.put(static_cast<char>(number));
+                putRex(out, 0, cellReg, true);
+                out.put(0xC7, 0xC0 | (cellReg & 7));    // mov reg, <value> (sign extended)
+                out.putInt(op.value);
             }
-            else if(cellSize == 2)
+            else if(cellReg != NO_REGISTER)
             {
-                out.put(0x66, 0x81, 0x03);  // add word [ebx], <number>
-                out.putShort(static_cast<int16_t>(number));
+                //Only the low part of the register is used
+                putRex(out, 0, cellReg);
+                out.put(0xB8 | (cellReg & 7));          // mov reg, <value>
+                out.putInt(op.value);
             }
             else
             {
-                out.put(0x81, 0x03);        // add dword [ebx], <number>
-                out.putInt(number);
+                //Store value directly
+                putCellOp(out, 0xC6, 0xC7, 0, op.offset);   // mov [ebx + offset], <value>
+                putCellImmediate(out, op.value);
             }
+            break;
         }
 
+    case ir::OP_MUL:
+        writeMultiply(out, cache, &op, 1);
         break;
 
-    case '-':
-        //Only 1?
-        if(number == 1)
-        {
-            //Insert an decrement
-            if(cellSize == 1)
-                out.put(0xFE, 0x0B);        // dec byte [ebx]
-            else if(cellSize == 2)
-                out.put(0x66, 0xFF, 0x0B);  // dec word [ebx]
-            else
-                out.put(0xFF, 0x0B);        // dec dword [ebx]
-        }
-        else
+    case ir::OP_MOVE:
+        writeMove(out, op.value);
+        break;
+
+    case ir::OP_SCAN:
+        writeScan(out, op.value);
+        break;
+
+    case ir::OP_LOOP_BEGIN:
+    case ir::OP_LOOP_END:
+        // Loops are written by writeProgram
+        break;
+
+    case ir::OP_OUTPUT:
+        writeOutput(out, cache, &op, 1);
+        break;
+
+    case ir::OP_INPUT:
         {
-            //Insert a sub
-            if(cellSize == 1)
+            EofCode eofCode = out.getEofCode();
+
+            // Read directly from the input buffer if possible
+            putRuntimeOp(out, 0x08, 0x8B, 0, offsetof(Runtime, inputPos));  // mov eax, [esi + inputPos]
+            putRuntimeOp(out, 0x08, 0x3B, 0, offsetof(Runtime, inputEnd));  // cmp eax, [esi + inputEnd]
+            uint32_t refillFixup = writeShortJump(out, 0x73);               // jae <refill>
+
+            putRuntimeOp(out, 0x08, 0xFF, 0, offsetof(Runtime, inputPos));  // inc [esi + inputPos]
+            out.put(0x0F, 0xB6, 0x00);      // movzx eax, byte [eax]
+            uint32_t storeFixup = writeShortJump(out, 0xEB);                // jmp <store>
+
+            // Refill the buffer and handle EOF
+            fixShortJump(out, refillFixup);
+            writeRuntimeCall(out, offsetof(Runtime, readInput));
+
+            uint32_t skipFixup = 0;
+
+            if(!eofCode.modifyValue)
             {
-                out.put(0x80, 0x2B);        // sub byte [ebx], <number>
-                out.put(static_cast<char>(number));
+                // Skip store if we're using ignore EOF
+                out.put(0x83, 0xF8, 0xFF);  // cmp eax, -1
+                skipFixup = writeShortJump(out, 0x74);                      // je <after store>
             }
-            else if(cellSize == 2)
+            else if(eofCode.code != -1)
             {
-                out.put(0x66, 0x81, 0x2B);  // sub word [ebx], <number>
-                out.putShort(static_cast<int16_t>(number));
+                // Replace the -1 with the EOF code
+                out.put(0x83, 0xF8, 0xFF);  // cmp eax, -1
+                uint32_t codeFixup = writeShortJump(out, 0x75);             // jne <store>
+                out.put(0xB8);              // mov eax, <code>
+                out.putInt(eofCode.code);
+                fixShortJump(out, codeFixup);
             }
-            else
+
+            // Store result
+            fixShortJump(out, storeFixup);
+            if(out.getCellSize() == 8)
+                out.put(0x48, 0x63, 0xC0);  // movsxd rax, eax
+
+            putCellOp(out, 0x88, 0x89, 0, op.offset);  // mov [ebx + offset], eax
+
+            if(skipFixup != 0)
+                fixShortJump(out, skipFixup);
+            break;
+        }
+    }
+}
+
+//Returns true if the loop starting at begin contains no other loops
+static bool isInnermostLoop(ir::Program const& program, uint32_t begin)
+{
+    for(uint32_t i = begin + 1; i < static_cast<uint32_t>(program[begin].value); i++)
+    {
+        if(program[i].type == ir::OP_LOOP_BEGIN)
+            return false;
+    }
+
+    return true;
+}
+
+//A stub which compiles part of the program the first time it is run
+struct LazyStub
+{
+    uint32_t begin;         // First operation to compile
+    uint32_t end;           // Operation after the last one to compile
+    uint32_t position;      // Position of the stub (patched with a jump to the code)
+    uint32_t resume;        // Position to continue at afterwards
+                            //  (0 if the code continues to the end of the program)
+};
+
+//State kept while a program is compiled lazily
+struct LazyCompiler
+{
+    CompilerState * out;
+    ir::Program program;
+    vector<bool> longLoops;
+    vector<LazyStub> stubs;
+};
+
+//Writes a stub which compiles the operations in [begin, end) when it is run
+// If resume is true, execution continues after the stub once the code has
+// run. Otherwise the code must run until the end of the program.
+static void writeStub(CompilerState& out, LazyCompiler& lazy, uint32_t begin, uint32_t end, bool resume)
+{
+    LazyStub stub = { begin, end, out.getPosition(), 0 };
+
+    //The first instruction is 5 bytes so it can be replaced by a jump
+    if(is64Bit(out))
+        out.put(0xBE);                  // mov esi, <stub>
+    else
+        out.put(0xBA);                  // mov edx, <stub>
+    out.putInt(static_cast<uint32_t>(lazy.stubs.size()));
+
+    writeRuntimeCall(out, offsetof(Runtime, compileStub));
+    out.put(0xFF, 0xE0);                // jmp eax
+
+    if(resume)
+        stub.resume = out.getPosition();
+
+    lazy.stubs.push_back(stub);
+}
+
+//A near jump into the header of a loop
+struct EntryJump
+{
+    uint32_t loop;          // Index of the OP_LOOP_BEGIN
+    uint32_t fixup;         // Position after the jump's rel32
+};
+
+//Writes the code for the operations in [begin, end)
+// Loops are skipped using short jumps unless they are marked in longLoops.
+// If lazy is not NULL, loops larger than LAZY_LOOP_SIZE (other than one
+// starting at begin) are replaced by stubs. If entry is not NULL, its jump is
+// fixed up to point to the header of its loop.
+// Returns false if a loop was found to be too large for a short jump (it is
+// then marked and the code must be written again).
+static bool writeCode(CompilerState& out, ir::Program const& program, uint32_t begin, uint32_t end,
+                      vector<bool>& longLoops, LazyCompiler * lazy, EntryJump const * entry = NULL)
+{
+    bool fits = true;
+
+    //True if the zero flag reflects the current cell
+    bool flagsValid = false;
+
+    //Loop headers start with code which changes the flags if the loops are
+    // counted or check the budget
+    Profile * profile = out.getProfile();
+    bool headerCode = out.getBudgetChecks() || (profile != NULL && profile->getMode() == Profile::COUNT);
+
+    RegisterCache cache;
+    cache.begin(out, program, begin, end);
+
+    for(uint32_t i = begin; i < end; i++)
+    {
+        ir::Op const& op = program[i];
+        out.markSource(op.sourcePos);
+
+        //Vector adds don't set the flags
+        uint32_t vectorRun = 0;
+
+        if(RegisterCache::endsBlock(op.type))
+        {
+            //Write back cached cells, testing the current cell while its
+            // value is still in a register
+            uint8_t currentReg = cache.flush(out);
+
+            if(currentReg != NO_REGISTER && !flagsValid &&
+                (op.type == ir::OP_LOOP_BEGIN || op.type == ir::OP_LOOP_END))
             {
-                out.put(0x81, 0x2B);        // sub dword [ebx], <number>
-                out.putInt(number);
+                putCellOp(out, 0x84, 0x85, currentReg, 0, currentReg);    // test reg, reg
+                flagsValid = true;
             }
         }
 
-        break;
+        if(op.type == ir::OP_OUTPUT)
+        {
+            //Write runs of output operations together
+            uint32_t count = 1;
+            while(count < MAX_OUTPUT_RUN && i + count < end &&
+                program[i + count].type == ir::OP_OUTPUT)
+            {
+                count++;
+            }
 
-    case '>':
-        //Add correct amount
-        if(byteInc == 1)
+            writeOutput(out, cache, &op, count);
+            i += count - 1;
+        }
+        else if(op.type == ir::OP_MUL)
         {
-            out.put(0x43);              // inc ebx
+            //Write the multiplications from one loop behind one test
+            uint32_t count = 1;
+            while(i + count < end && program[i + count].type == ir::OP_MUL &&
+                program[i + count].srcOffset == op.srcOffset)
+            {
+                count++;
+            }
+
+            writeMultiply(out, cache, &op, count);
+            i += count - 1;
         }
-        else if(byteInc <= 0x7F)        // Sign-Extended
+        else if(op.type == ir::OP_ADD && (vectorRun = findVectorRun(out, cache, program, i, end)) != 0)
         {
-            out.put(0x83, 0xC3);        // add ebx, byte <byteInc>
-            out.put(static_cast<char>(byteInc));
+            //Write runs of additions to nearby cells with one vector add
+            writeVectorRun(out, cache, &op, vectorRun);
+            i += vectorRun - 1;
         }
-        else
+        else if(op.type == ir::OP_LOOP_BEGIN && lazy != NULL && i != begin &&
+            static_cast<uint32_t>(op.value) - i > LAZY_LOOP_SIZE)
         {
-            out.put(0x81, 0xC3);        // add ebx, dword <byteInc>
-            out.putInt(byteInc);
+            //Compile large loops when they are first entered
+            writeStub(out, *lazy, i, op.value + 1, true);
+            i = op.value;
         }
+        else if(op.type == ir::OP_LOOP_BEGIN)
+        {
+            //Count entries before the loop header and iterations after it
+            int32_t counter = -1;
+            if(profile != NULL)
+            {
+                uint32_t loop = profile->addLoop(op.sourcePos, program[op.value].sourcePos, out.getPosition());
+                if(profile->getMode() == Profile::COUNT)
+                    counter = static_cast<int32_t>(loop * 2);
+            }
 
-        break;
+            writeLoopBegin(out, longLoops[i], !flagsValid,
+                isInnermostLoop(program, i) ? INNER_LOOP_ALIGNMENT : LOOP_ALIGNMENT, counter);
 
-    case '<':
-        //Subtract correct amount
-        if(byteInc == 1)
-        {
-            out.put(0x4B);              // dec ebx
+            if(entry != NULL && entry->loop == i)
+                out.putRelativeAt(entry->fixup - 4, out.loopStack().top());
+
+            if(counter >= 0)
+                writeCounterIncrement(out, counter + 1);
+
+            if(out.getBudgetChecks())
+                writeBudgetCheck(out);
         }
-        else if(byteInc <= 0x7F)        // Sign-Extended
+        else if(op.type == ir::OP_LOOP_END)
         {
-            out.put(0x83, 0xEB);        // sub ebx, byte <byteInc>
-            out.put(static_cast<char>(byteInc));
+            if(!writeLoopEnd(out, longLoops[op.value], !flagsValid))
+            {
+                longLoops[op.value] = true;
+                fits = false;
+            }
+
+            if(profile != NULL)
+                profile->setLoopEnd(program[op.value].sourcePos, out.getPosition());
         }
         else
         {
-            out.put(0x81, 0xEB);        // sub ebx, dword <byteInc>
-            out.putInt(byteInc);
+            processOp(out, cache, op);
+
+            //Loops and scans test the new cell straight away
+            if(op.type == ir::OP_MOVE && (i + 1 == end || (program[i + 1].type != ir::OP_LOOP_BEGIN &&
+                program[i + 1].type != ir::OP_LOOP_END && program[i + 1].type != ir::OP_SCAN)))
+            {
+                writeProbe(out);
+            }
         }
 
-        break;
+        if(RegisterCache::endsBlock(op.type))
+            cache.begin(out, program, i + 1, end);
 
-    case '[':
-        // Emit jump and store loop start location on the stack
-        out.put(0xE9);                  // jmp near <location>
-        out.loopStack().push(out.getPosition());
-        out.putInt(0);
-        break;
+        //Inside a loop and after it, the flags are left from testing the
+        // current cell. Arithmetic on the current cell also sets them.
+        // (stubs are skipped over by i so they never leave the flags valid,
+        // and neither does code at the loop header or skipped multiplications)
+        flagsValid = (op.type == ir::OP_LOOP_BEGIN && program[i].type == ir::OP_LOOP_BEGIN && !headerCode) ||
+            op.type == ir::OP_LOOP_END ||
+            (op.type == ir::OP_ADD && op.offset == 0 && vectorRun == 0);
+
+        //Writing it again won't help if there isn't enough space
+        if(out.failed())
+            return true;
+    }
+
+    cache.flush(out);
+    return fits;
+}
+
+//Writes the code from begin to the end of the program
+// If lazy is not NULL, only about LAZY_CHUNK_SIZE operations are written
+// followed by a stub which compiles the rest.
+static bool writeTail(CompilerState& out, ir::Program const& program, uint32_t begin,
+                      vector<bool>& longLoops, LazyCompiler * lazy, EntryJump const * entry = NULL)
+{
+    uint32_t end = static_cast<uint32_t>(program.size());
 
-    case ']':
+    if(lazy != NULL)
+    {
+        //Whole loops are included so the chunk ends at the top level
+        end = begin;
+        while(end < program.size() && end - begin < LAZY_CHUNK_SIZE)
         {
-            // Detect loop mismatch
-            if(out.loopStack().empty())
-                throw MismatchedBraketsException();
-
-            // Get fixup position
-            uint32_t fixupAddr = out.loopStack().top();
-            out.loopStack().pop();
-
-            // Fix address to jump to current location
-            out.putRelativeAt(fixupAddr, out.getPosition());
-
-            // Write loop end
-            if(cellSize == 1)
-                out.put(0x80, 0x3B, 0x00);        // cmp byte [ebx], 0
-            else if(cellSize == 2)
-                out.put(0x66, 0x83, 0x3B, 0x00);  // cmp word [ebx], 0
-            else
-                out.put(0x83, 0x3B, 0x00);        // cmp word [ebx], 0
+            if(program[end].type == ir::OP_LOOP_BEGIN)
+                end = program[end].value;
 
-            out.put(0x0F, 0x85);            // jnz near <location>
-            out.putRelative(fixupAddr + 4);
-            break;
+            end++;
         }
+    }
 
-    case '.':
-        // Store character to display
-        if(cellSize == 1)
-            out.put(0x0F, 0xB6, 0x0B);  // movzx ecx, byte [ebx]
-        else if(cellSize == 2)
-            out.put(0x0F, 0xB7, 0x0B);  // movzx ecx, word [ebx]
-        else
-            out.put(0x8B, 0x0B);        // mov ecx, [ebx]
+    bool fits = writeCode(out, program, begin, end, longLoops, lazy, entry);
 
-        // Call outputCallback
-        out.put(0xE8);                  // call near <location>
-        out.putRelative(outputCallback);
-        break;
+    if(end < program.size())
+        writeStub(out, *lazy, end, static_cast<uint32_t>(program.size()), false);
+    else
+        writeEpilog(out);
 
-    case ',':
-        {
-            // Get eof character
-            EofCode eofCode = out.getEofCode();
-            int32_t codeToUse;
+    return fits;
+}
 
-            if(eofCode.modifyValue)
-                codeToUse = eofCode.code;
-            else
-                codeToUse = -1;
+//Writes code copying output stored in the code at ebx to the output buffer
+// The buffer is flushed whenever it fills up. Afterwards ebx points to the
+// end of the output.
+static void writePrefixOutput(CompilerState& out, uint32_t size)
+{
+    bool x64 = is64Bit(out);
 
-            // Store it in ecx
-            out.put(0xB9);                  // mov ecx, <number>
-            out.putInt(codeToUse);
+    //The end of the output is kept on the stack (twice in x86-64 so calls
+    // are still aligned)
+    if(x64)
+        out.put(0x48);
+    out.put(0x8D, 0x83);                // lea eax, [ebx + <size>]
+    out.putInt(size);
+    out.put(0x50);                      // push eax
+    if(x64)
+        out.put(0x50);                  // push rax
 
-            // Call inputCallback
-            out.put(0xE8);                  // call near <location>
-            out.putRelative(inputCallback);
+    uint32_t loop = out.getPosition();
+    if(x64)
+        out.put(0x48);
+    out.put(0x8B, 0x0C, 0x24);          // mov ecx, [esp]
+    if(x64)
+        out.put(0x48);
+    out.put(0x29, 0xD9);                // sub ecx, ebx
+    uint32_t doneFixup = writeShortJump(out, 0x74);                    // jz short <done>
 
-            // Skip store if we're using ignore EOF
-            if(!eofCode.modifyValue)
-            {
-                out.put(0x83, 0xF8, 0xFF);  // cmp eax, -1
+    putRuntimeOp(out, 0x08, 0x8B, 0, offsetof(Runtime, outputEnd));   // mov eax, [esi + outputEnd]
+    if(x64)
+        out.put(0x4C, 0x29, 0xE8);      // sub rax, r13
+    else
+        out.put(0x29, 0xF8);            // sub eax, edi
+    uint32_t copyFixup = writeShortJump(out, 0x75);                    // jnz short <copy>
 
-                if(cellSize == 2)
-                    out.put(0x74, 0x03);    // je +3
-                else
-                    out.put(0x74, 0x02);    // je +2
-            }
+    writeRuntimeCall(out, offsetof(Runtime, flushOutput));
+    writeShortJumpBack(out, 0xEB, loop);                                // jmp short <loop>
 
-            // Store result
-            if(cellSize == 1)
-                out.put(0x88, 0x03);        // mov [ebx], al
-            else if(cellSize == 2)
-                out.put(0x66, 0x89, 0x03);  // mov [ebx], ax
-            else
-                out.put(0x89, 0x03);        // mov [ebx], eax
+    //Copy as much as fits in the buffer
+    fixShortJump(out, copyFixup);
+    if(x64)
+    {
+        out.put(0x48, 0x39, 0xC1);          // cmp rcx, rax
+        out.put(0x48, 0x0F, 0x47, 0xC8);    // cmova rcx, rax
+        out.put(0x48, 0x89, 0xDE);          // mov rsi, rbx
+        out.put(0x4C, 0x89, 0xEF);          // mov rdi, r13
+        out.put(0xF3, 0xA4);                // rep movsb
+        out.put(0x49, 0x89, 0xFD);          // mov r13, rdi
+        out.put(0x48, 0x89, 0xF3);          // mov rbx, rsi
+    }
+    else
+    {
+        out.put(0x39, 0xC1);                // cmp ecx, eax
+        out.put(0x0F, 0x47, 0xC8);          // cmova ecx, eax
+        out.put(0x56);                      // push esi
+        out.put(0x89, 0xDE);                // mov esi, ebx
+        out.put(0xF3, 0xA4);                // rep movsb
+        out.put(0x89, 0xF3);                // mov ebx, esi
+        out.put(0x5E);                      // pop esi
+    }
+    writeShortJumpBack(out, 0xEB, loop);                                // jmp short <loop>
 
-            break;
-        }
+    fixShortJump(out, doneFixup);
+    out.put(0x58);                      // pop eax
+    if(x64)
+        out.put(0x58);                  // pop rax
+}
+
+//Writes code copying a tape image stored in the code at ebx to the tape
+static void writePrefixTape(CompilerState& out, uint32_t size)
+{
+    if(is64Bit(out))
+    {
+        out.put(0x48, 0x89, 0xDE);                                  // mov rsi, rbx
+        putRuntimeOp(out, 0x08, 0x8B, 7, offsetof(Runtime, tape)); // mov rdi, [r12 + tape]
+        out.put(0xB9);                                              // mov ecx, <size>
+        out.putInt(size);
+        out.put(0xF3, 0xA4);                                        // rep movsb
+    }
+    else
+    {
+        out.put(0x57);                                              // push edi
+        out.put(0x56);                                              // push esi
+        putRuntimeOp(out, 0, 0x8B, 7, offsetof(Runtime, tape));    // mov edi, [esi + tape]
+        out.put(0x89, 0xDE);                                        // mov esi, ebx
+        out.put(0xB9);                                              // mov ecx, <size>
+        out.putInt(size);
+        out.put(0xF3, 0xA4);                                        // rep movsb
+        out.put(0x5E);                                              // pop esi
+        out.put(0x5F);                                              // pop edi
+    }
+}
+
+//Writes code recreating the state left by running a prefix at compile time
+// The output and tape image are stored in the code after a call over them
+// (which pushes their address).
+static void writePrefix(CompilerState& out, ir::Prefix const& prefix)
+{
+    uint32_t outputSize = static_cast<uint32_t>(prefix.output.size());
+    uint32_t tapeSize = static_cast<uint32_t>(prefix.tape.size());
+
+    if(outputSize != 0 || tapeSize != 0)
+    {
+        out.put(0xE8);                  // call <after data>
+        out.putInt(outputSize + tapeSize);
+
+        for(uint32_t i = 0; i < outputSize; i++)
+            out.put(prefix.output[i]);
+        for(uint32_t i = 0; i < tapeSize; i++)
+            out.put(prefix.tape[i]);
+
+        out.put(0x5B);                  // pop ebx
+
+        //The tape image follows the output
+        if(outputSize != 0)
+            writePrefixOutput(out, outputSize);
+        if(tapeSize != 0)
+            writePrefixTape(out, tapeSize);
+
+        putRuntimeOp(out, 0x08, 0x8B, 3, offsetof(Runtime, tape));    // mov ebx, [esi + tape]
+    }
+
+    if(prefix.pointer != 0)
+        writeMove(out, prefix.pointer);
+}
+
+//Writes the code for a program
+// If prefix is not NULL, the code starts with the state it contains and
+// continues from its resume point.
+// Returns false if the program must be written again (see writeCode)
+static bool writeProgram(CompilerState& out, ir::Program const& program, ir::Prefix const * prefix,
+                         vector<bool>& longLoops, LazyCompiler * lazy)
+{
+    writeProlog(out);
+
+    //Continue from the budget check which stopped the program last time
+    if(out.getBudgetChecks())
+    {
+        putRuntimeOp(out, 0x08, 0x8B, 0, offsetof(Runtime, resume));  // mov eax, [esi + resume]
+        if(is64Bit(out))
+            out.put(0x48);
+        out.put(0x85, 0xC0);            // test eax, eax
+        uint32_t start = writeShortJump(out, 0x74);                     // jz short <start>
+
+        putRuntimeOp(out, 0x08, 0x83, 4, offsetof(Runtime, resume));  // and [esi + resume], 0
+        out.put(0);
+        out.put(0xFF, 0xE0);            // jmp eax
+
+        //Tape faults continue here to stop the program
+        out.setFaultExit(out.getPosition());
+        saveOutputPos(out);
+        writeReturn(out);
+
+        fixShortJump(out, start);
+    }
+
+    if(prefix == NULL)
+        return writeTail(out, program, 0, longLoops, lazy);
+
+    writePrefix(out, *prefix);
+
+    if(!prefix->inLoop)
+        return writeTail(out, program, prefix->resume, longLoops, lazy);
+
+    //Write the code from the outermost loop containing the resume point and
+    // jump into the header of the loop it is in
+    uint32_t begin = 0;
+    while(begin != prefix->resume &&
+        !(program[begin].type == ir::OP_LOOP_BEGIN && static_cast<uint32_t>(program[begin].value) > prefix->resume))
+    {
+        if(program[begin].type == ir::OP_LOOP_BEGIN)
+            begin = program[begin].value;
+
+        begin++;
     }
+
+    putCellArithmetic(out, 7, 0, 0);    // cmp [ebx], 0 (the header expects the flags of a non-zero cell)
+    out.put(0xE9);                      // jmp <header>
+    out.putInt(0);
+
+    EntryJump entry = { prefix->resume, out.getPosition() };
+    return writeTail(out, program, begin, longLoops, lazy, &entry);
 }
 
-//Type of data being buffered
-#define BUFFER_NONE     0
-#define BUFFER_VALUE    1
-#define BUFFER_POINTER  2
+//Prints an error from the generated code and exits
+static void fatalError(char const * message)
+{
+    fputs(message, stderr);
+    exit(1);
+}
 
-//Processes the current buffered characters
-void processBuffer(CompilerState& out, uint32_t& bufferType, int32_t& bufferNumber,
-                   uint32_t newType = BUFFER_NONE, int32_t newNumber = 0)
+//Compiles the code for a stub and replaces the stub with a jump to it
+// Called by the generated code
+static void * BF_FASTCALL compileStub(Runtime * runtime, uint32_t stubIndex)
 {
-    //Flush buffer?
-    if(bufferType != BUFFER_NONE && bufferType != newType && bufferNumber != 0)
+    LazyCompiler& lazy = *static_cast<LazyCompiler *>(runtime->compiler);
+    CompilerState& out = *lazy.out;
+    LazyStub stub = lazy.stubs[stubIndex];
+
+    if(!out.getCodeBuffer()->protectWritable())
+        fatalError("Failed to make code memory writable\n");
+
+    //Write the code until every loop uses a jump which is large enough
+    uint32_t start = out.getPosition();
+    size_t stubCount = lazy.stubs.size();
+
+    for(;;)
     {
-        //Get correct character and number
-        char properChar;
-        uint32_t properNumber;
+        bool fits;
 
-        if(bufferNumber >= 0)
+        if(stub.resume != 0)
         {
-            properNumber = bufferNumber;
-            properChar = bufferType == BUFFER_VALUE ? '+' : '>';
+            fits = writeCode(out, lazy.program, stub.begin, stub.end, lazy.longLoops, &lazy);
+            out.put(0xE9);              // jmp <resume>
+            out.putRelative(stub.resume);
         }
         else
         {
-            properNumber = -bufferNumber;
-            properChar = bufferType == BUFFER_VALUE ? '-' : '<';
+            fits = writeTail(out, lazy.program, stub.begin, lazy.longLoops, &lazy);
         }
 
-        //Process it
-        processChar(out, properChar, properNumber);
+        if(fits)
+            break;
 
-        //Reset bufferNumber
-        bufferNumber = newNumber;
+        out.rewind(start);
+        lazy.stubs.resize(stubCount);
     }
-    else
+
+    if(out.failed())
+        fatalError("Brainfuck program too large\n");
+
+    //Jump straight to the code next time
+    out.putAt(stub.position, 0xE9);     // jmp <code>
+    out.putRelativeAt(stub.position + 1, start);
+
+    if(!out.getCodeBuffer()->protectExecutable())
+        fatalError("Failed to make code memory executable\n");
+
+    return out.getAddress(start);
+}
+
+bool bf::writeLoopFunction(CompilerState& out, ir::Program const& program, uint32_t begin)
+{
+    uint32_t start = out.getPosition();
+    uint32_t end = program[begin].value + 1;
+    vector<bool> longLoops(end, false);
+
+    //Write the loop until every loop uses a jump which is large enough
+    for(;;)
     {
-        //Update bufferNumber
-        bufferNumber += newNumber;
+        writeProlog(out);
+        bool fits = writeCode(out, program, begin, end, longLoops, NULL);
+
+        putRuntimeOp(out, 0x08, 0x89, 3, offsetof(Runtime, tape));    // mov [esi + tape], ebx
+        writeEpilog(out, false);
+
+        if(fits)
+            break;
+
+        out.rewind(start);
     }
 
-    //Update bufferType
-    bufferType = newType;
+    return !out.failed();
 }
 
 CompileResult bf::compile(std::istream& input, CompilerState& out)
 {
-    //Write prolog
-    writeProlog(out);
+    //Parse program
+    ir::Program program;
+    SourceLocation errorLocation;
+    CompileResult result = ir::parse(input, program, &errorLocation);
+
+    if(result == MISMATCHED_BRAKETS)
+        out.setErrorLocation(errorLocation);
 
-    //Process input
-    uint32_t bufferType = BUFFER_NONE;
-    int32_t bufferNumber = 0;
+    if(result != OK)
+        return result;
 
-    try
+    //Optimize it
+    ir::PassManager passes;
+    ir::addDefaultPasses(passes);
+    passes.run(program, out.getDumpOutput());
+
+    //Write the program until every loop uses a jump which is large enough
+    // (loops only ever change from short to near jumps so this terminates)
+    vector<bool> longLoops(program.size(), false);
+
+    //Run the start of the program which doesn't depend on its input
+    // (the counts would be wrong and budgets not charged for it otherwise)
+    ir::Prefix prefix;
+    ir::Prefix * prefixPtr = NULL;
+
+    if(out.getPrefixSteps() != 0 && !out.getBudgetChecks() && out.getProfile() == NULL &&
+        ir::evaluatePrefix(program, out.getCellSize(), out.getPrefixSteps(), prefix))
     {
-        for(;;)
+        prefixPtr = &prefix;
+
+        if(out.getDumpOutput() != NULL)
         {
-            //Get next character
-            int c = input.get();
-
-            //Test for immediate failiures
-            if(out.failed())
-                return OUT_OF_OUTPUT_SPACE;
-            else if(input.eof())
-                break;
-            else if(input.fail())
-                return IO_ERROR;
-
-            //What is it?
-            switch(c)
-            {
-            case '+':
-                processBuffer(out, bufferType, bufferNumber, BUFFER_VALUE, 1);
-                break;
-
-            case '-':
-                processBuffer(out, bufferType, bufferNumber, BUFFER_VALUE, -1);
-                break;
-
-            case '>':
-                processBuffer(out, bufferType, bufferNumber, BUFFER_POINTER, 1);
-                break;
-
-            case '<':
-                processBuffer(out, bufferType, bufferNumber, BUFFER_POINTER, -1);
-                break;
-
-            case '[':
-            case ']':
-            case '.':
-            case ',':
-                //Ignore buffer and process directly
-                processBuffer(out, bufferType, bufferNumber);
-                processChar(out, c);
-                break;
-            }
+            *out.getDumpOutput() << "; prefix (" << prefix.steps << " steps, resuming at " <<
+                prefix.resume << (prefix.inLoop ? " in loop)\n" : ")\n");
         }
     }
-    catch(MismatchedBraketsException)
+
+    while(!writeProgram(out, program, prefixPtr, longLoops, NULL))
+        out.reset();
+
+    if(out.failed())
+        return OUT_OF_OUTPUT_SPACE;
+
+    return OK;
+}
+
+CompileResult bf::executeLazy(std::istream& input, CompilerState& out, void * tape)
+{
+    LazyCompiler lazy;
+    lazy.out = &out;
+
+    //Parse and optimize the program as usual
+    SourceLocation errorLocation;
+    CompileResult result = ir::parse(input, lazy.program, &errorLocation);
+
+    if(result == MISMATCHED_BRAKETS)
+        out.setErrorLocation(errorLocation);
+
+    if(result != OK)
+        return result;
+
+    ir::PassManager passes;
+    ir::addDefaultPasses(passes);
+    passes.run(lazy.program, out.getDumpOutput());
+
+    //Write the start of the program
+    lazy.longLoops.assign(lazy.program.size(), false);
+
+    while(!writeProgram(out, lazy.program, NULL, lazy.longLoops, &lazy))
     {
-        //Mismatched brakets
-        return MISMATCHED_BRAKETS;
+        out.reset();
+        lazy.stubs.clear();
     }
 
-    //Since the buffer cannot hold any i/o or loop chars, it doesn't need processing
-
-    //Ensure loop stack is empty
-    if(!out.loopStack().empty())
-        return MISMATCHED_BRAKETS;
+    if(out.failed() || !out.getCodeBuffer()->protectExecutable())
+        return OUT_OF_OUTPUT_SPACE;
 
-    //Write epilog
-    writeEpilog(out);
+    executeWithStubs(out.getAddress(0), tape, compileStub, &lazy);
     return OK;
 }
@@ -5,11 +5,40 @@
 //
 
 #include <istream>
+#include <ostream>
 #include <cstdint>
 #include <stack>
+#include <vector>
+#include "BfCodeBuffer.h"
 
 namespace bf
 {
+    class Profile;
+
+    // The instruction set to generate code for
+    enum Architecture
+    {
+        ARCH_X86,               // 32-bit x86 (fastcall callbacks)
+        ARCH_X86_64,            // 64-bit x86-64 (System V ABI)
+
+#if defined(_M_X64) || defined(__x86_64__)
+        ARCH_NATIVE = ARCH_X86_64,
+#else
+        ARCH_NATIVE = ARCH_X86,
+#endif
+    };
+
+    // Vector instruction set extensions which the generated code may use
+    enum VectorExtension
+    {
+        VECTOR_NONE,            // Only scalar instructions
+        VECTOR_SSE2,            // 128-bit SSE2
+        VECTOR_AVX2,            // 256-bit AVX2
+    };
+
+    // Detects the best vector extension supported by this processor
+    VectorExtension detectVectorExtension();
+
     // Information about the type of code which represents an EOF
     struct EofCode
     {
@@ -32,6 +61,24 @@ namespace bf
         }
     };
 
+    // An entry in the map from generated code to source positions
+    struct SourceMapEntry
+    {
+        std::uint32_t codePos;          // Start of the code
+        std::uint32_t sourcePos;        // Source position it was generated from
+    };
+
+    // A line and column in the source (both start at 1)
+    struct SourceLocation
+    {
+        std::uint32_t line;
+        std::uint32_t column;
+    };
+
+    // Map from generated code to source positions (ordered by code position)
+    //  Each entry covers the code up to the next entry.
+    typedef std::vector<SourceMapEntry> SourceMap;
+
     // Provides the INPUT for the compiler
     class CompilerState
     {
@@ -39,9 +86,18 @@ namespace bf
         // Compiler results and options
         std::uint8_t * output_;
         std::uint32_t outputSize_;
-        void * heap_;
+        CodeBuffer * buffer_;
         std::uint8_t cellSize_;
         EofCode eofCode_;
+        Architecture arch_;
+        VectorExtension vector_;
+        bool budgetChecks_;
+        std::uint64_t prefixSteps_;
+        Profile * profile_;
+        SourceMap * sourceMap_;
+        std::ostream * dumpOutput_;
+        SourceLocation errorLocation_;
+        std::uint32_t faultExit_;
 
         // Current position
         std::uint32_t pos_;
@@ -50,18 +106,26 @@ namespace bf
         // Loop stack
         std::stack<std::uint32_t> loopStack_;
 
+        // Grows the code buffer so the byte at pos_ can be written
+        bool grow();
+
     public:
         // Creates a new compiler state with the given options
         //  output       = Memory location to store code at
         //  outputSize   = Size of output
-        //  heap         = Pointer to the heap memory
-        //  cellSize     = Size of cells to use (must be 1, 2 or 4)
+        //  cellSize     = Size of cells to use (must be 1, 2 or 4, or 8 in x86-64)
         //  eofCode      = What code to produce on EOF (see bf::EofCode)
-        CompilerState(void * output, std::uint32_t outputSize, void * heap,
-            std::uint8_t cellSize = 1, EofCode eofCode = EofCode(-1));
+        //  arch         = Instruction set to generate (the code can only be
+        //                  executed if this is the native architecture)
+        CompilerState(void * output, std::uint32_t outputSize,
+            std::uint8_t cellSize = 1, EofCode eofCode = EofCode(-1),
+            Architecture arch = ARCH_NATIVE);
 
-        // Gets the heap address
-        void * getHeap() const;
+        // Creates a new compiler state storing code in a code buffer
+        //  The buffer is grown as needed (up to its maximum size)
+        CompilerState(CodeBuffer& buffer,
+            std::uint8_t cellSize = 1, EofCode eofCode = EofCode(-1),
+            Architecture arch = ARCH_NATIVE);
 
         // Gets the current output address
         std::uint32_t getPosition() const;
@@ -75,6 +139,68 @@ namespace bf
         // Gets the EOF Code in use
         EofCode const& getEofCode() const;
 
+        // Gets the architecture code is generated for
+        Architecture getArchitecture() const;
+
+        // Gets or sets the vector extension the code may use
+        //  (defaults to the extension detected by detectVectorExtension)
+        VectorExtension getVectorExtension() const;
+        void setVectorExtension(VectorExtension vector);
+
+        // Gets or sets whether loops check the runtime's step budget
+        //  (defaults to false, see bf::Program)
+        bool getBudgetChecks() const;
+        void setBudgetChecks(bool budgetChecks);
+
+        // Gets or sets the most operations compile runs at compile time
+        //  The start of the program which does not depend on its input is
+        //  run by the compiler and the code starts with its results (0, the
+        //  default, disables this). Programs with budget checks or a profile
+        //  are never run at compile time.
+        std::uint64_t getPrefixSteps() const;
+        void setPrefixSteps(std::uint64_t prefixSteps);
+
+        // Gets or sets the profile the loops are recorded in
+        //  (NULL to disable profiling, see bf::Profile)
+        Profile * getProfile() const;
+        void setProfile(Profile * profile);
+
+        // Gets or sets the stream the intermediate representation is dumped to
+        //  (NULL to disable dumping)
+        std::ostream * getDumpOutput() const;
+        void setDumpOutput(std::ostream * dumpOutput);
+
+        // Gets or sets the map the source positions of the code are recorded in
+        //  (NULL to disable the map)
+        SourceMap * getSourceMap() const;
+        void setSourceMap(SourceMap * sourceMap);
+
+        // Gets or sets the location of the bracket which made compiling fail
+        //  (only set when MISMATCHED_BRAKETS is returned)
+        SourceLocation const& getErrorLocation() const;
+        void setErrorLocation(SourceLocation const& location);
+
+        // Gets or sets the position of the code which returns from the program
+        // after a tape fault (0 if there isn't any)
+        //  Only programs with budget checks contain this code (see bf::Tape::setRecovery)
+        std::uint32_t getFaultExit() const;
+        void setFaultExit(std::uint32_t position);
+
+        // Records that the following code is generated from the given source position
+        void markSource(std::uint32_t sourcePos);
+
+        // Gets the code buffer the code is stored in (NULL if there isn't one)
+        CodeBuffer * getCodeBuffer() const;
+
+        // Discards all the code written so far (the options are kept)
+        void reset();
+
+        // Discards the code (and source map entries) written after the given position
+        void rewind(std::uint32_t position);
+
+        // Gets the absolute address of the given output position
+        void * getAddress(std::uint32_t position) const;
+
         // Gets the loop stack (containing positions)
         std::stack<std::uint32_t>& loopStack();
         std::stack<std::uint32_t> const& loopStack() const;
@@ -88,6 +214,7 @@ namespace bf
         // Number putters
         void putShort(std::uint16_t number);
         void putInt(std::uint32_t number);
+        void putLong(std::uint64_t number);
 
         // Relative position putter
         void putRelative(std::uint32_t relPosition);
@@ -112,6 +239,28 @@ namespace bf
 
     // Compiles a brainfuck program to machine code
     CompileResult compile(std::istream& input, CompilerState& state);
+
+    // Compiles a brainfuck program lazily and executes it
+    //  Only the start of the program is compiled before it is run. Large loops
+    //  and the rest of the program are compiled the first time they are
+    //  reached, so the code cannot be saved and run again.
+    //  state        = Compiler state (must use a CodeBuffer)
+    //  tape         = Pointer to the first cell (aligned to the cell size)
+    CompileResult executeLazy(std::istream& input, CompilerState& state, void * tape);
+
+    // Interprets a brainfuck program, compiling loops once they become hot
+    //  Short programs start running without waiting for the compiler and long
+    //  running loops are switched to machine code between iterations.
+    //  state        = Compiler state (must use a CodeBuffer and the native architecture)
+    //  tape         = Pointer to the first cell (aligned to the cell size)
+    CompileResult executeTiered(std::istream& input, CompilerState& state, void * tape);
+
+    // Executes code produced by the compiler
+    //  The code does not contain any absolute addresses so it can be copied
+    //  or loaded from a file before being executed.
+    //  code         = Start of the compiled code (must be executable)
+    //  tape         = Pointer to the first cell (aligned to the cell size)
+    void execute(void const * code, void * tape);
 }
 
 #endif
@@ -0,0 +1,341 @@
+#include "BfDebugInfo.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <elf.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace bf;
+
+// Debug information for native tools
+//
+
+//Source position which isn't in any loop
+#define NO_LOOP UINT32_MAX
+
+#ifndef _WIN32
+
+// GDB JIT interface
+//  gdb sets a breakpoint in __jit_debug_register_code and reads the list of
+//  symbol files in __jit_debug_descriptor whenever it is called. The names
+//  and layouts must not be changed.
+extern "C"
+{
+    enum JitActions
+    {
+        JIT_NOACTION = 0,
+        JIT_REGISTER_FN,
+        JIT_UNREGISTER_FN,
+    };
+
+    struct jit_code_entry
+    {
+        jit_code_entry * next_entry;
+        jit_code_entry * prev_entry;
+        char const * symfile_addr;
+        uint64_t symfile_size;
+    };
+
+    struct jit_descriptor
+    {
+        uint32_t version;
+        uint32_t action_flag;
+        jit_code_entry * relevant_entry;
+        jit_code_entry * first_entry;
+    };
+
+    void __attribute__((noinline)) __jit_debug_register_code()
+    {
+        __asm__ __volatile__("");
+    }
+
+    jit_descriptor __jit_debug_descriptor = { 1, JIT_NOACTION, NULL, NULL };
+}
+
+//Lock for the GDB JIT descriptor
+static mutex jitLock;
+
+//ELF types for this machine
+#if defined(__x86_64__)
+typedef Elf64_Ehdr ElfHeader;
+typedef Elf64_Shdr ElfSection;
+typedef Elf64_Sym ElfSymbol;
+#define ELF_CLASS ELFCLASS64
+#define ELF_MACHINE EM_X86_64
+#define ELF_SYMBOL_INFO(bind, type) ELF64_ST_INFO(bind, type)
+#else
+typedef Elf32_Ehdr ElfHeader;
+typedef Elf32_Shdr ElfSection;
+typedef Elf32_Sym ElfSymbol;
+#define ELF_CLASS ELFCLASS32
+#define ELF_MACHINE EM_386
+#define ELF_SYMBOL_INFO(bind, type) ELF32_ST_INFO(bind, type)
+#endif
+
+#endif
+
+//A symbol covering part of the code
+struct CodeSymbol
+{
+    uint32_t begin;
+    uint32_t end;
+    string name;
+};
+
+//Finds the symbols for some code
+static void findSymbols(uint32_t codeSize, SourceMap const& sourceMap,
+                        string const& source, vector<CodeSymbol>& symbols)
+{
+    //Find the innermost loop around each source position and where lines start
+    vector<uint32_t> loops(source.size(), NO_LOOP);
+    vector<uint32_t> open;
+    vector<uint32_t> lineStarts(1, 0);
+
+    for(uint32_t i = 0; i < source.size(); i++)
+    {
+        if(source[i] == '[')
+            open.push_back(i);
+
+        loops[i] = open.empty() ? NO_LOOP : open.back();
+
+        if(source[i] == ']' && !open.empty())
+            open.pop_back();
+        else if(source[i] == '\n')
+            lineStarts.push_back(i + 1);
+    }
+
+    //Split the code where the innermost loop changes
+    uint32_t start = 0;
+    uint32_t loop = NO_LOOP;
+
+    for(size_t i = 0; i <= sourceMap.size(); i++)
+    {
+        uint32_t end = codeSize;
+        uint32_t nextLoop = NO_LOOP;
+
+        if(i < sourceMap.size())
+        {
+            end = sourceMap[i].codePos;
+            if(sourceMap[i].sourcePos < loops.size())
+                nextLoop = loops[sourceMap[i].sourcePos];
+
+            if(nextLoop == loop)
+                continue;
+        }
+
+        if(end > start)
+        {
+            char name[64];
+
+            if(loop == NO_LOOP)
+            {
+                strcpy(name, "bf_main");
+            }
+            else
+            {
+                size_t line = 0;
+                while(line + 1 < lineStarts.size() && lineStarts[line + 1] <= loop)
+                    line++;
+
+                sprintf(name, "bf_loop_%u_%u", static_cast<unsigned>(line + 1),
+                    static_cast<unsigned>(loop - lineStarts[line] + 1));
+            }
+
+            CodeSymbol symbol = { start, end, name };
+            symbols.push_back(symbol);
+        }
+
+        start = end;
+        loop = nextLoop;
+    }
+}
+
+#ifndef _WIN32
+//Creates an ELF file containing symbols for some code
+// The .text section is not stored in the file but has the address of the code
+static void writeElf(vector<char>& image, char const * code, uint32_t codeSize,
+                     vector<CodeSymbol> const& symbols)
+{
+    //Section names (offsets are used below)
+    static char const sectionNames[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+
+    string names(1, '\0');
+    vector<ElfSymbol> elfSymbols(1);
+    memset(&elfSymbols[0], 0, sizeof(ElfSymbol));
+
+    for(size_t i = 0; i < symbols.size(); i++)
+    {
+        ElfSymbol symbol;
+        memset(&symbol, 0, sizeof(symbol));
+        symbol.st_name = static_cast<uint32_t>(names.size());
+        symbol.st_value = reinterpret_cast<uintptr_t>(code) + symbols[i].begin;
+        symbol.st_size = symbols[i].end - symbols[i].begin;
+        symbol.st_info = ELF_SYMBOL_INFO(STB_LOCAL, STT_FUNC);
+        symbol.st_shndx = 1;
+
+        names.append(symbols[i].name);
+        names.push_back('\0');
+        elfSymbols.push_back(symbol);
+    }
+
+    //Layout: header, section names, symbol names, symbols, section headers
+    size_t sectionNamesOffset = sizeof(ElfHeader);
+    size_t namesOffset = sectionNamesOffset + sizeof(sectionNames);
+    size_t symbolsOffset = (namesOffset + names.size() + 7) & ~static_cast<size_t>(7);
+    size_t sectionsOffset = symbolsOffset + elfSymbols.size() * sizeof(ElfSymbol);
+
+    image.assign(sectionsOffset + 5 * sizeof(ElfSection), 0);
+
+    ElfHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELF_CLASS;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_type = ET_EXEC;
+    header.e_machine = ELF_MACHINE;
+    header.e_version = EV_CURRENT;
+    header.e_shoff = sectionsOffset;
+    header.e_ehsize = sizeof(ElfHeader);
+    header.e_shentsize = sizeof(ElfSection);
+    header.e_shnum = 5;
+    header.e_shstrndx = 4;
+
+    ElfSection sections[5];
+    memset(sections, 0, sizeof(sections));
+
+    sections[1].sh_name = 1;                // .text
+    sections[1].sh_type = SHT_NOBITS;
+    sections[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    sections[1].sh_addr = reinterpret_cast<uintptr_t>(code);
+    sections[1].sh_size = codeSize;
+    sections[1].sh_addralign = 16;
+
+    sections[2].sh_name = 7;                // .symtab
+    sections[2].sh_type = SHT_SYMTAB;
+    sections[2].sh_offset = symbolsOffset;
+    sections[2].sh_size = elfSymbols.size() * sizeof(ElfSymbol);
+    sections[2].sh_link = 3;
+    sections[2].sh_info = static_cast<uint32_t>(elfSymbols.size());   // All symbols are local
+    sections[2].sh_addralign = 8;
+    sections[2].sh_entsize = sizeof(ElfSymbol);
+
+    sections[3].sh_name = 15;               // .strtab
+    sections[3].sh_type = SHT_STRTAB;
+    sections[3].sh_offset = namesOffset;
+    sections[3].sh_size = names.size();
+    sections[3].sh_addralign = 1;
+
+    sections[4].sh_name = 23;               // .shstrtab
+    sections[4].sh_type = SHT_STRTAB;
+    sections[4].sh_offset = sectionNamesOffset;
+    sections[4].sh_size = sizeof(sectionNames);
+    sections[4].sh_addralign = 1;
+
+    memcpy(&image[0], &header, sizeof(header));
+    memcpy(&image[sectionNamesOffset], sectionNames, sizeof(sectionNames));
+    memcpy(&image[namesOffset], names.data(), names.size());
+    memcpy(&image[symbolsOffset], &elfSymbols[0], elfSymbols.size() * sizeof(ElfSymbol));
+    memcpy(&image[sectionsOffset], sections, sizeof(sections));
+}
+
+//Appends symbols to the perf map of this process
+static bool writePerfMap(char const * code, vector<CodeSymbol> const& symbols)
+{
+    char path[64];
+    sprintf(path, "/tmp/perf-%d.map", static_cast<int>(::getpid()));
+
+    FILE * file = fopen(path, "a");
+    if(file == NULL)
+        return false;
+
+    for(size_t i = 0; i < symbols.size(); i++)
+    {
+        fprintf(file, "%llx %x %s\n",
+            static_cast<unsigned long long>(reinterpret_cast<uintptr_t>(code) + symbols[i].begin),
+            symbols[i].end - symbols[i].begin, symbols[i].name.c_str());
+    }
+
+    return fclose(file) == 0;
+}
+#endif
+
+bf::DebugInfo::DebugInfo()
+    : entry_(NULL)
+{
+}
+
+bf::DebugInfo::~DebugInfo()
+{
+#ifndef _WIN32
+    if(entry_ == NULL)
+        return;
+
+    jit_code_entry * entry = static_cast<jit_code_entry *>(entry_);
+    lock_guard<mutex> lock(jitLock);
+
+    //Remove the entry from the list
+    if(entry->prev_entry != NULL)
+        entry->prev_entry->next_entry = entry->next_entry;
+    else
+        __jit_debug_descriptor.first_entry = entry->next_entry;
+
+    if(entry->next_entry != NULL)
+        entry->next_entry->prev_entry = entry->prev_entry;
+
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+
+    delete entry;
+#endif
+}
+
+bool bf::DebugInfo::publish(void const * code, std::uint32_t codeSize,
+    SourceMap const& sourceMap, std::string const& source)
+{
+#ifdef _WIN32
+    (void) code;
+    (void) codeSize;
+    (void) sourceMap;
+    (void) source;
+    return false;
+#else
+    if(entry_ != NULL)
+        return false;
+
+    vector<CodeSymbol> symbols;
+    findSymbols(codeSize, sourceMap, source, symbols);
+
+    char const * start = static_cast<char const *>(code);
+    writeElf(image_, start, codeSize, symbols);
+    bool ok = writePerfMap(start, symbols);
+
+    //Add the entry to the start of gdb's list
+    jit_code_entry * entry = new jit_code_entry();
+    entry->symfile_addr = &image_[0];
+    entry->symfile_size = image_.size();
+    entry->prev_entry = NULL;
+
+    lock_guard<mutex> lock(jitLock);
+    entry->next_entry = __jit_debug_descriptor.first_entry;
+    if(entry->next_entry != NULL)
+        entry->next_entry->prev_entry = entry;
+
+    __jit_debug_descriptor.first_entry = entry;
+    __jit_debug_descriptor.relevant_entry = entry;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+
+    entry_ = entry;
+    return ok;
+#endif
+}
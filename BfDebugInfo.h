@@ -0,0 +1,47 @@
+#ifndef _BFDEBUGINFO_H
+#define _BFDEBUGINFO_H
+
+// Brainfuck Debug Information
+//
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "BfCompiler.h"
+
+namespace bf
+{
+    // Symbols describing compiled code for native profilers and debuggers
+    //  The code is split into a symbol for each loop (named bf_loop_<line>_<column>
+    //  after its '[') and bf_main for the code outside any loop. Symbols are
+    //  written to /tmp/perf-<pid>.map for perf and given to gdb as an
+    //  in-memory ELF file through the GDB JIT interface.
+    class DebugInfo
+    {
+    private:
+        std::vector<char> image_;
+        void * entry_;
+
+        // DebugInfo cannot be copied
+        DebugInfo(DebugInfo const&);
+        DebugInfo& operator=(DebugInfo const&);
+
+    public:
+        DebugInfo();
+
+        // Unregisters the code from gdb (the perf map is kept for perf report)
+        ~DebugInfo();
+
+        // Publishes symbols for some code
+        //  code         = Start of the code
+        //  codeSize     = Size of the code
+        //  sourceMap    = Source map recorded while compiling the code
+        //  source       = Source the code was compiled from
+        //  Returns false if the symbols could not be published (the code can
+        //  only be published once)
+        bool publish(void const * code, std::uint32_t codeSize,
+            SourceMap const& sourceMap, std::string const& source);
+    };
+}
+
+#endif
@@ -0,0 +1,545 @@
+#include "BfExecutable.h"
+#include "BfRuntime.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+using namespace bf;
+
+// Standalone executables
+//  The file is mapped as a single read only, executable segment containing
+//  the headers, the runtime and the generated code. The Runtime and the I/O
+//  buffers are in a second segment and the tape is in a third one with
+//  unmapped guard regions of BF_GUARD_SIZE around it (the generated code
+//  can't reach past them, so the second segment is never written through
+//  the tape pointer). Addresses below 2GB are used so every address in the
+//  runtime fits in a sign extended 32-bit immediate.
+//
+
+//Address the file is loaded at
+#define BASE_ADDRESS_X86 0x08048000
+#define BASE_ADDRESS_X86_64 0x00400000
+
+//Alignment of segments
+#define SEGMENT_ALIGNMENT 4096
+
+//Highest address the tape can start at
+#define MAX_TAPE_ADDRESS 0x7FFFFFFF
+
+//Most space the runtime code can use
+#define MAX_RUNTIME_SIZE 1024
+
+//Layout of the data segment
+// The Runtime uses one 8 byte slot for each pointer sized field (4 bytes are
+// used in 32-bit executables)
+#define RUNTIME_OFFSET 0
+#define RUNTIME_SIZE 256
+#define SIGACTION_OFFSET (RUNTIME_OFFSET + RUNTIME_SIZE)
+#define OUTPUT_BUFFER_OFFSET 1024
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define INPUT_BUFFER_OFFSET (OUTPUT_BUFFER_OFFSET + OUTPUT_BUFFER_SIZE)
+#define INPUT_BUFFER_SIZE (64 * 1024)
+#define DATA_SIZE (INPUT_BUFFER_OFFSET + INPUT_BUFFER_SIZE)
+
+//Registers
+#define REG_EAX 0
+#define REG_ECX 1
+#define REG_EDX 2
+#define REG_EBX 3
+#define REG_ESI 6
+#define REG_EDI 7
+#define REG_R10 10
+
+//Signal constants (the same on both architectures)
+#define SIGNAL_SEGV 11
+#define SIGNAL_FLAGS 0x04000004     // SA_RESTORER | SA_SIGINFO
+
+//Linux system calls
+struct SystemCalls
+{
+    uint32_t read;
+    uint32_t write;
+    uint32_t exitGroup;
+    uint32_t rtSigaction;
+    uint8_t args[4];                // Registers holding the arguments
+    uint8_t siginfoAddress;         // Offset of si_addr in siginfo_t
+};
+
+static SystemCalls const SYSCALLS_X86 = { 3, 4, 252, 174, { REG_EBX, REG_ECX, REG_EDX, REG_ESI }, 12 };
+static SystemCalls const SYSCALLS_X86_64 = { 0, 1, 231, 13, { REG_EDI, REG_ESI, REG_EDX, REG_R10 }, 16 };
+
+//Messages printed by the fault handler (the same as the compiler's tape)
+static char const UNDERFLOW_MESSAGE[] = "Tape underflow: the pointer moved before the start of the tape\n";
+static char const OVERFLOW_MESSAGE[] = "Tape overflow: the pointer moved past the end of the tape\n";
+
+//Addresses of everything in the executable
+struct Layout
+{
+    uint32_t runtimeCode;           // Start of the runtime code
+    uint32_t code;                  // Start of the generated code
+    uint32_t data;                  // Start of the data segment
+    uint32_t tape;                  // Start of the tape
+};
+
+//Addresses of the runtime functions (filled in by writeRuntime)
+struct RuntimeFunctions
+{
+    uint32_t start;
+    uint32_t flushOutput;
+    uint32_t readInput;
+    uint32_t faultHandler;
+};
+
+//Returns true if generating 64-bit code
+static bool is64Bit(CompilerState& out)
+{
+    return out.getArchitecture() == ARCH_X86_64;
+}
+
+static SystemCalls const& getSystemCalls(CompilerState& out)
+{
+    return is64Bit(out) ? SYSCALLS_X86_64 : SYSCALLS_X86;
+}
+
+//Rounds a value up to a multiple of alignment (a power of 2)
+static uint64_t alignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+//Gets the address of a field in the executable's Runtime
+// Only pointer sized fields can be used
+static uint32_t getRuntimeField(CompilerState& out, Layout const& layout, size_t field)
+{
+    return static_cast<uint32_t>(layout.data + RUNTIME_OFFSET +
+        field / sizeof(void *) * (is64Bit(out) ? 8 : 4));
+}
+
+//Gets the address of the next byte of runtime code
+static uint32_t getAddress(CompilerState& out, Layout const& layout)
+{
+    return layout.runtimeCode + out.getPosition();
+}
+
+//Writes a pointer sized instruction with an absolute memory operand
+// reg = register / opcode extension stored in the ModRM byte
+static void putAbsoluteOp(CompilerState& out, uint8_t opcode, uint8_t reg, uint32_t address)
+{
+    if(is64Bit(out))
+    {
+        out.put(0x48, opcode);
+        out.put(0x04 | (reg << 3), 0x25);       // [disp32]
+    }
+    else
+    {
+        out.put(opcode, 0x05 | (reg << 3));     // [disp32]
+    }
+
+    out.putInt(address);
+}
+
+//Writes a pointer sized instruction with two register operands
+static void putRegisterOp(CompilerState& out, uint8_t opcode, uint8_t reg, uint8_t rm)
+{
+    if(is64Bit(out))
+        out.put(0x48);
+
+    out.put(opcode, 0xC0 | (reg << 3) | rm);
+}
+
+//Stores an immediate in a pointer sized field
+static void writeStoreImmediate(CompilerState& out, uint32_t address, uint32_t value)
+{
+    putAbsoluteOp(out, 0xC7, 0, address);       // mov [address], <value>
+    out.putInt(value);
+}
+
+//Loads an immediate into a register (zero extended)
+static void writeLoadImmediate(CompilerState& out, uint8_t reg, uint32_t value)
+{
+    if(reg & 8)
+        out.put(0x41);
+
+    out.put(0xB8 | (reg & 7));                  // mov reg, <value>
+    out.putInt(value);
+}
+
+static void writeSystemCall(CompilerState& out)
+{
+    if(is64Bit(out))
+        out.put(0x0F, 0x05);                    // syscall
+    else
+        out.put(0xCD, 0x80);                    // int 0x80
+}
+
+//Writes a short conditional jump to be fixed up later
+static uint32_t writeShortJump(CompilerState& out, uint8_t opcode)
+{
+    out.put(opcode, 0x00);                      // j<cc> short <location>
+    return out.getPosition();
+}
+
+//Fixes up a jump written by writeShortJump to point to the current position
+static void fixShortJump(CompilerState& out, uint32_t position)
+{
+    out.putAt(position - 1, static_cast<uint8_t>(out.getPosition() - position));
+}
+
+//Writes a short jump back to the given position
+static void writeShortJumpBack(CompilerState& out, uint8_t opcode, uint32_t target)
+{
+    out.put(opcode, static_cast<uint8_t>(target - out.getPosition() - 2));
+}
+
+//Writes a call to an absolute address
+static void writeCall(CompilerState& out, Layout const& layout, uint32_t target)
+{
+    out.put(0xE8);                              // call <target>
+    out.putInt(target - getAddress(out, layout) - 4);
+}
+
+//Writes flushOutput
+// Writes the output buffer to stdout, giving up on errors like the compiler's runtime
+static void writeFlushOutput(CompilerState& out, Layout const& layout)
+{
+    SystemCalls const& calls = getSystemCalls(out);
+    uint8_t data = calls.args[1];
+    uint32_t outputPos = getRuntimeField(out, layout, offsetof(Runtime, outputPos));
+
+    if(!is64Bit(out))
+        out.put(0x53);                          // push ebx
+
+    putAbsoluteOp(out, 0x8B, data, getRuntimeField(out, layout, offsetof(Runtime, outputBuffer)));
+    putAbsoluteOp(out, 0x8B, REG_EDX, outputPos);               // mov edx, [outputPos]
+    putAbsoluteOp(out, 0x89, data, outputPos);                  // mov [outputPos], <data>
+    putRegisterOp(out, 0x29, data, REG_EDX);                    // sub edx, <data>
+
+    uint32_t loop = out.getPosition();
+    uint32_t doneFixup = writeShortJump(out, 0x7E);             // jle <done>
+
+    //Write as much as possible (restarting interrupted calls)
+    uint32_t retry = out.getPosition();
+    writeLoadImmediate(out, calls.args[0], 1);                  // stdout
+    writeLoadImmediate(out, REG_EAX, calls.write);
+    writeSystemCall(out);
+
+    putRegisterOp(out, 0x83, 7, REG_EAX);                       // cmp eax, -EINTR
+    out.put(0xFC);
+    writeShortJumpBack(out, 0x74, retry);                       // je <retry>
+
+    putRegisterOp(out, 0x85, REG_EAX, REG_EAX);                 // test eax, eax
+    uint32_t errorFixup = writeShortJump(out, 0x7E);            // jle <done>
+
+    putRegisterOp(out, 0x01, REG_EAX, data);                    // add <data>, eax
+    putRegisterOp(out, 0x29, REG_EAX, REG_EDX);                 // sub edx, eax
+    writeShortJumpBack(out, 0xEB, loop);                        // jmp <loop>
+
+    fixShortJump(out, doneFixup);
+    fixShortJump(out, errorFixup);
+
+    if(!is64Bit(out))
+        out.put(0x5B);                          // pop ebx
+
+    out.put(0xC3);                              // ret
+}
+
+//Writes readInput
+// Returns the next input byte or -1 on EOF
+static void writeReadInput(CompilerState& out, Layout const& layout, uint32_t flushOutput)
+{
+    SystemCalls const& calls = getSystemCalls(out);
+    uint8_t data = calls.args[1];
+    uint32_t inputPos = getRuntimeField(out, layout, offsetof(Runtime, inputPos));
+    uint32_t inputEnd = getRuntimeField(out, layout, offsetof(Runtime, inputEnd));
+    uint32_t inputEof = getRuntimeField(out, layout, offsetof(Runtime, inputEof));
+
+    if(!is64Bit(out))
+        out.put(0x53);                          // push ebx
+
+    putAbsoluteOp(out, 0x8B, REG_EAX, inputPos);                // mov eax, [inputPos]
+    putAbsoluteOp(out, 0x3B, REG_EAX, inputEnd);                // cmp eax, [inputEnd]
+    uint32_t haveFixup = writeShortJump(out, 0x72);             // jb <have>
+
+    putAbsoluteOp(out, 0x83, 7, inputEof);                      // cmp [inputEof], 0
+    out.put(0x00);
+    uint32_t eofFixup = writeShortJump(out, 0x75);              // jne <eof>
+
+    //Write any pending output first so prompts are displayed
+    writeCall(out, layout, flushOutput);
+
+    //Read the next block of input (restarting interrupted calls)
+    uint32_t retry = out.getPosition();
+    writeLoadImmediate(out, calls.args[0], 0);                  // stdin
+    writeLoadImmediate(out, data, layout.data + INPUT_BUFFER_OFFSET);
+    writeLoadImmediate(out, REG_EDX, INPUT_BUFFER_SIZE);
+    writeLoadImmediate(out, REG_EAX, calls.read);
+    writeSystemCall(out);
+
+    putRegisterOp(out, 0x83, 7, REG_EAX);                       // cmp eax, -EINTR
+    out.put(0xFC);
+    writeShortJumpBack(out, 0x74, retry);                       // je <retry>
+
+    putRegisterOp(out, 0x85, REG_EAX, REG_EAX);                 // test eax, eax
+    uint32_t endFixup = writeShortJump(out, 0x7E);              // jle <end of input>
+
+    putRegisterOp(out, 0x01, data, REG_EAX);                    // add eax, <data>
+    putAbsoluteOp(out, 0x89, REG_EAX, inputEnd);                // mov [inputEnd], eax
+    putRegisterOp(out, 0x89, data, REG_EAX);                    // mov eax, <data>
+
+    //Consume the byte at eax
+    fixShortJump(out, haveFixup);
+    if(is64Bit(out))
+        out.put(0x48);
+
+    out.put(0x8D, 0x50, 0x01);                                  // lea edx, [eax + 1]
+    putAbsoluteOp(out, 0x89, REG_EDX, inputPos);                // mov [inputPos], edx
+    out.put(0x0F, 0xB6, 0x00);                                  // movzx eax, byte [eax]
+    uint32_t returnFixup = writeShortJump(out, 0xEB);           // jmp <return>
+
+    //No more input
+    fixShortJump(out, endFixup);
+    writeStoreImmediate(out, inputEof, 1);
+
+    fixShortJump(out, eofFixup);
+    out.put(0x83, 0xC8, 0xFF);                                  // or eax, -1
+
+    fixShortJump(out, returnFixup);
+
+    if(!is64Bit(out))
+        out.put(0x5B);                          // pop ebx
+
+    out.put(0xC3);                              // ret
+}
+
+//Writes the SIGSEGV handler
+// Prints an error and exits (faults can only come from the tape pointer)
+static void writeFaultHandler(CompilerState& out, Layout const& layout,
+                              uint32_t underflowMessage, uint32_t overflowMessage)
+{
+    SystemCalls const& calls = getSystemCalls(out);
+
+    //Get the faulting address
+    if(is64Bit(out))
+    {
+        out.put(0x48, 0x8B, 0x46, calls.siginfoAddress);        // mov rax, [rsi + si_addr]
+    }
+    else
+    {
+        out.put(0x8B, 0x44, 0x24, 0x08);                        // mov eax, [esp + 8]
+        out.put(0x8B, 0x40, calls.siginfoAddress);              // mov eax, [eax + si_addr]
+    }
+
+    writeLoadImmediate(out, calls.args[1], overflowMessage);
+    writeLoadImmediate(out, REG_EDX, sizeof(OVERFLOW_MESSAGE) - 1);
+
+    if(is64Bit(out))
+        out.put(0x48);
+
+    out.put(0x3D);                                              // cmp eax, <tape>
+    out.putInt(layout.tape);
+    uint32_t writeFixup = writeShortJump(out, 0x73);            // jae <write>
+
+    writeLoadImmediate(out, calls.args[1], underflowMessage);
+    writeLoadImmediate(out, REG_EDX, sizeof(UNDERFLOW_MESSAGE) - 1);
+
+    fixShortJump(out, writeFixup);
+    writeLoadImmediate(out, calls.args[0], 2);                  // stderr
+    writeLoadImmediate(out, REG_EAX, calls.write);
+    writeSystemCall(out);
+
+    writeLoadImmediate(out, calls.args[0], 1);
+    writeLoadImmediate(out, REG_EAX, calls.exitGroup);
+    writeSystemCall(out);
+}
+
+//Writes the entry point
+// Installs the fault handler, sets up the Runtime, runs the code and exits
+static void writeStart(CompilerState& out, Layout const& layout, RuntimeFunctions const& functions)
+{
+    SystemCalls const& calls = getSystemCalls(out);
+    uint32_t pointerSize = is64Bit(out) ? 8 : 4;
+    uint32_t sigaction = layout.data + SIGACTION_OFFSET;
+    uint32_t outputBuffer = layout.data + OUTPUT_BUFFER_OFFSET;
+    uint32_t inputBuffer = layout.data + INPUT_BUFFER_OFFSET;
+
+    //Install the fault handler (the signal mask is left as zeros)
+    // It never returns so it is also used as the restorer
+    writeStoreImmediate(out, sigaction, functions.faultHandler);
+    writeStoreImmediate(out, sigaction + pointerSize, SIGNAL_FLAGS);
+    writeStoreImmediate(out, sigaction + pointerSize * 2, functions.faultHandler);
+
+    writeLoadImmediate(out, calls.args[0], SIGNAL_SEGV);
+    writeLoadImmediate(out, calls.args[1], sigaction);
+    writeLoadImmediate(out, calls.args[2], 0);
+    writeLoadImmediate(out, calls.args[3], 8);                  // Size of the signal mask
+    writeLoadImmediate(out, REG_EAX, calls.rtSigaction);
+    writeSystemCall(out);
+
+    //Set up the Runtime
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, tape)), layout.tape);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, flushOutput)), functions.flushOutput);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, readInput)), functions.readInput);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, outputBuffer)), outputBuffer);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, outputPos)), outputBuffer);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, outputEnd)),
+        outputBuffer + OUTPUT_BUFFER_SIZE);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, inputBuffer)), inputBuffer);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, inputPos)), inputBuffer);
+    writeStoreImmediate(out, getRuntimeField(out, layout, offsetof(Runtime, inputEnd)), inputBuffer);
+
+    //Run the program (the code flushes the output before returning)
+    writeLoadImmediate(out, is64Bit(out) ? REG_EDI : REG_ECX, layout.data + RUNTIME_OFFSET);
+    writeCall(out, layout, layout.code);
+
+    writeLoadImmediate(out, calls.args[0], 0);
+    writeLoadImmediate(out, REG_EAX, calls.exitGroup);
+    writeSystemCall(out);
+}
+
+//Writes the whole runtime
+static void writeRuntime(CompilerState& out, Layout const& layout, RuntimeFunctions& functions)
+{
+    functions.flushOutput = getAddress(out, layout);
+    writeFlushOutput(out, layout);
+
+    functions.readInput = getAddress(out, layout);
+    writeReadInput(out, layout, functions.flushOutput);
+
+    uint32_t underflowMessage = getAddress(out, layout);
+    for(size_t i = 0; i < sizeof(UNDERFLOW_MESSAGE) - 1; i++)
+        out.put(static_cast<uint8_t>(UNDERFLOW_MESSAGE[i]));
+
+    uint32_t overflowMessage = getAddress(out, layout);
+    for(size_t i = 0; i < sizeof(OVERFLOW_MESSAGE) - 1; i++)
+        out.put(static_cast<uint8_t>(OVERFLOW_MESSAGE[i]));
+
+    functions.faultHandler = getAddress(out, layout);
+    writeFaultHandler(out, layout, underflowMessage, overflowMessage);
+
+    functions.start = getAddress(out, layout);
+    writeStart(out, layout, functions);
+}
+
+//Writes an ELF field which is the size of an address
+static void putAddress(CompilerState& out, uint64_t value)
+{
+    if(is64Bit(out))
+        out.putLong(value);
+    else
+        out.putInt(static_cast<uint32_t>(value));
+}
+
+//Writes an ELF program header
+static void putProgramHeader(CompilerState& out, uint32_t type, uint32_t flags, uint32_t address,
+                             uint64_t fileSize, uint64_t memorySize, uint32_t alignment)
+{
+    out.putInt(type);
+
+    if(is64Bit(out))
+        out.putInt(flags);
+
+    putAddress(out, 0);                         // Offset
+    putAddress(out, address);                   // Virtual address
+    putAddress(out, address);                   // Physical address
+    putAddress(out, fileSize);
+    putAddress(out, memorySize);
+
+    if(!is64Bit(out))
+        out.putInt(flags);
+
+    putAddress(out, alignment);
+}
+
+bool bf::writeExecutable(std::string const& path, CompilerState const& state, std::size_t tapeSize)
+{
+    Architecture arch = state.getArchitecture();
+    bool is64 = (arch == ARCH_X86_64);
+    uint32_t codeSize = state.getPosition();
+
+    uint32_t base = is64 ? BASE_ADDRESS_X86_64 : BASE_ADDRESS_X86;
+    uint32_t headerSize = is64 ? 64 : 52;
+    uint32_t programHeaderSize = is64 ? 56 : 32;
+    uint32_t runtimeOffset = static_cast<uint32_t>(alignUp(headerSize + 4 * programHeaderSize, 16));
+
+    //Write the runtime once to find its size (the instructions used do not
+    // depend on the addresses)
+    vector<uint8_t> runtime(MAX_RUNTIME_SIZE);
+    CompilerState runtimeOut(&runtime[0], MAX_RUNTIME_SIZE, 1, EofCode(), arch);
+    RuntimeFunctions functions;
+    Layout layout = { base + runtimeOffset, 0, 0, 0 };
+
+    writeRuntime(runtimeOut, layout, functions);
+    if(runtimeOut.failed())
+        return false;
+
+    //Lay out the segments
+    // The lower guard region is the gap between the data segment and the tape
+    uint64_t codeOffset = alignUp(runtimeOffset + runtimeOut.getPosition(), 16);
+    uint64_t fileSize = codeOffset + codeSize;
+    uint64_t data = alignUp(base + fileSize, SEGMENT_ALIGNMENT);
+    uint64_t tape = alignUp(data + DATA_SIZE, SEGMENT_ALIGNMENT) + BF_GUARD_SIZE;
+    uint64_t tapeEnd = tape + alignUp(tapeSize, SEGMENT_ALIGNMENT);
+
+    if(tape > MAX_TAPE_ADDRESS || (!is64 && tapeEnd + BF_GUARD_SIZE > 0xC0000000))
+        return false;
+
+    layout.code = static_cast<uint32_t>(base + codeOffset);
+    layout.data = static_cast<uint32_t>(data);
+    layout.tape = static_cast<uint32_t>(tape);
+
+    runtimeOut.reset();
+    writeRuntime(runtimeOut, layout, functions);
+
+    //Write the headers
+    vector<uint8_t> image(static_cast<size_t>(fileSize));
+    CompilerState out(&image[0], static_cast<uint32_t>(fileSize), 1, EofCode(), arch);
+
+    out.put(0x7F, 'E', 'L', 'F');
+    out.put(is64 ? 2 : 1, 1, 1, 0);             // Class, little endian, version, System V ABI
+    out.putLong(0);
+    out.putShort(2);                            // ET_EXEC
+    out.putShort(is64 ? 62 : 3);                // EM_X86_64 or EM_386
+    out.putInt(1);                              // Version
+    putAddress(out, functions.start);           // Entry point
+    putAddress(out, headerSize);                // Program header offset
+    putAddress(out, 0);                         // No section headers
+    out.putInt(0);                              // Flags
+    out.putShort(static_cast<uint16_t>(headerSize));
+    out.putShort(static_cast<uint16_t>(programHeaderSize));
+    out.putShort(4);                            // Number of program headers
+    out.putShort(0);
+    out.putShort(0);
+    out.putShort(0);
+
+    putProgramHeader(out, 1, 5, base, fileSize, fileSize, SEGMENT_ALIGNMENT);       // PT_LOAD (R X)
+    putProgramHeader(out, 1, 6, layout.data, 0, DATA_SIZE, SEGMENT_ALIGNMENT);      // PT_LOAD (R W)
+    putProgramHeader(out, 1, 6, layout.tape, 0, tapeEnd - tape, SEGMENT_ALIGNMENT); // PT_LOAD (R W)
+    putProgramHeader(out, 0x6474E551, 6, 0, 0, 0, 16);                              // PT_GNU_STACK
+
+    //Add the code
+    memcpy(&image[runtimeOffset], &runtime[0], runtimeOut.getPosition());
+    memcpy(&image[static_cast<size_t>(codeOffset)], state.getAddress(0), codeSize);
+
+    ofstream file(path.c_str(), ios::out | ios::trunc | ios::binary);
+    file.write(reinterpret_cast<char const *>(&image[0]), image.size());
+
+    if(!file.flush())
+        return false;
+
+    file.close();
+
+#ifndef _WIN32
+    if(::chmod(path.c_str(), 0755) != 0)
+        return false;
+#endif
+
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef _BFEXECUTABLE_H
+#define _BFEXECUTABLE_H
+
+// Brainfuck Executable Writer
+//
+
+#include <cstddef>
+#include <string>
+#include "BfCompiler.h"
+
+namespace bf
+{
+    // Writes the code generated by state to a standalone Linux executable
+    //  The executable is a static ELF file containing the code, a small
+    //  runtime which does buffered I/O with system calls, and the Runtime,
+    //  I/O buffers and tape in uninitialized (.bss) segments. It does not
+    //  need the compiler or any libraries to run. Moving the pointer outside
+    //  the tape prints an error like the compiler's tape does.
+    //  The code must not be compiled lazily or with budget checks or a
+    //  counting profile, and can be for either architecture (not just the
+    //  native one).
+    //  path         = File to write (made executable)
+    //  state        = Compiler state containing the program
+    //  tapeSize     = Size of the tape (in bytes)
+    //  Returns false if the file could not be written or the program and
+    //  tape are too large
+    bool writeExecutable(std::string const& path, CompilerState const& state, std::size_t tapeSize);
+}
+
+#endif
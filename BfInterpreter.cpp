@@ -0,0 +1,250 @@
+#include "BfCompiler.h"
+#include "BfIr.h"
+#include "BfRuntime.h"
+#include <istream>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+using namespace bf;
+
+// Tiered execution
+//  Programs start running in an interpreter over the intermediate
+//  representation. Loops which run for long enough are compiled to machine
+//  code and run natively from then on.
+//
+
+//Number of iterations after which a loop is compiled
+#define HOT_LOOP_ITERATIONS 1000
+
+//State of a program being run by the interpreter
+struct TieredProgram
+{
+    CompilerState * out;
+    ir::Program program;
+
+    // Iterations run by the interpreter of each loop (indexed by OP_LOOP_BEGIN)
+    vector<uint32_t> iterations;
+
+    // Compiled code of each loop (NULL if not compiled)
+    vector<void const *> code;
+
+    // Operations run by the interpreter
+    uint64_t opsRun;
+};
+
+//Compiles the loop starting at begin
+// Returns NULL if it could not be compiled
+static void const * compileLoop(TieredProgram& tiered, uint32_t begin)
+{
+    CompilerState& out = *tiered.out;
+    CodeBuffer * buffer = out.getCodeBuffer();
+    uint32_t start = out.getPosition();
+
+    if(!buffer->protectWritable())
+        return NULL;
+
+    bool ok = writeLoopFunction(out, tiered.program, begin);
+
+    if(!buffer->protectExecutable() || !ok)
+    {
+        out.rewind(start);
+        return NULL;
+    }
+
+    tiered.code[begin] = out.getAddress(start);
+    return tiered.code[begin];
+}
+
+//Runs compiled loop code starting at the given cell
+// Returns the pointer after the loop
+template<typename Cell>
+static Cell * runLoop(Runtime& runtime, void const * code, Cell * ptr)
+{
+    runtime.tape = reinterpret_cast<uint8_t *>(ptr);
+    reinterpret_cast<EntryPoint>(const_cast<void *>(code))(&runtime);
+    return reinterpret_cast<Cell *>(runtime.tape);
+}
+
+//Moves the pointer by the given number of cells
+// Like the generated code, the pointer is tested at least every half guard
+// region so leaving the tape always faults in a guard region.
+template<typename Cell>
+static Cell * movePointer(Cell * ptr, int32_t cells)
+{
+    int32_t const step = BF_GUARD_SIZE / 2 / sizeof(Cell);
+
+    for(; cells > step; cells -= step)
+    {
+        ptr += step;
+        static_cast<void>(*const_cast<Cell volatile *>(ptr));
+    }
+
+    for(; cells < -step; cells += step)
+    {
+        ptr -= step;
+        static_cast<void>(*const_cast<Cell volatile *>(ptr));
+    }
+
+    ptr += cells;
+    static_cast<void>(*const_cast<Cell volatile *>(ptr));
+    return ptr;
+}
+
+//Interprets a program using cells of the given type
+template<typename Cell>
+static void interpret(TieredProgram& tiered, Runtime& runtime)
+{
+    ir::Program const& program = tiered.program;
+    EofCode eofCode = tiered.out->getEofCode();
+    Cell * ptr = reinterpret_cast<Cell *>(runtime.tape);
+
+    for(uint32_t i = 0; i < program.size(); i++)
+    {
+        ir::Op const& op = program[i];
+        tiered.opsRun++;
+
+        switch(op.type)
+        {
+        case ir::OP_ADD:
+            ptr[op.offset] = static_cast<Cell>(ptr[op.offset] + op.value);
+            break;
+
+        case ir::OP_SET:
+            ptr[op.offset] = static_cast<Cell>(op.value);
+            break;
+
+        case ir::OP_MUL:
+            //The target is left alone if the loop would not have run
+            if(ptr[op.srcOffset] != 0)
+                ptr[op.offset] = static_cast<Cell>(ptr[op.offset] + ptr[op.srcOffset] * op.value);
+            break;
+
+        case ir::OP_MOVE:
+            ptr = movePointer(ptr, op.value);
+            break;
+
+        case ir::OP_SCAN:
+            while(*ptr != 0)
+                ptr = movePointer(ptr, op.value);
+            break;
+
+        case ir::OP_LOOP_BEGIN:
+            if(*ptr == 0)
+            {
+                //Skip loop
+                i = op.value;
+            }
+            else if(tiered.code[i] != NULL)
+            {
+                //Run the whole loop natively
+                ptr = runLoop(runtime, tiered.code[i], ptr);
+                i = op.value;
+            }
+            break;
+
+        case ir::OP_LOOP_END:
+            if(*ptr != 0)
+            {
+                //Loops are compiled at a back edge once they become hot and
+                // the rest of the loop runs natively
+                uint32_t& iterations = tiered.iterations[op.value];
+
+                if(iterations < HOT_LOOP_ITERATIONS && ++iterations == HOT_LOOP_ITERATIONS &&
+                    compileLoop(tiered, op.value) != NULL)
+                {
+                    ptr = runLoop(runtime, tiered.code[op.value], ptr);
+                }
+                else
+                {
+                    i = op.value;
+                }
+            }
+            break;
+
+        case ir::OP_OUTPUT:
+            if(runtime.outputPos >= runtime.outputEnd)
+                runtime.flushOutput(&runtime);
+
+            *runtime.outputPos++ = static_cast<uint8_t>(ptr[op.offset]);
+            break;
+
+        case ir::OP_INPUT:
+            {
+                int c;
+
+                if(runtime.inputPos < runtime.inputEnd)
+                    c = *runtime.inputPos++;
+                else
+                    c = runtime.readInput(&runtime);
+
+                if(c != -1)
+                    ptr[op.offset] = static_cast<Cell>(c);
+                else if(eofCode.modifyValue)
+                    ptr[op.offset] = static_cast<Cell>(eofCode.code);
+                break;
+            }
+        }
+    }
+
+    //Write any remaining output
+    runtime.flushOutput(&runtime);
+}
+
+//Runs the interpreter for the cell size of the program
+static void runInterpreter(TieredProgram& tiered, Runtime& runtime)
+{
+    if(tiered.out->getCellSize() == 1)
+        interpret<uint8_t>(tiered, runtime);
+    else if(tiered.out->getCellSize() == 2)
+        interpret<uint16_t>(tiered, runtime);
+    else if(tiered.out->getCellSize() == 4)
+        interpret<uint32_t>(tiered, runtime);
+    else
+        interpret<uint64_t>(tiered, runtime);
+}
+
+std::uint64_t bf::interpret(ir::Program const& program, CompilerState& out, Runtime& runtime)
+{
+    TieredProgram tiered;
+    tiered.out = &out;
+    tiered.program = program;
+    tiered.opsRun = 0;
+
+    //Loops which are already hot are never compiled
+    tiered.iterations.assign(program.size(), HOT_LOOP_ITERATIONS);
+    tiered.code.assign(program.size(), NULL);
+
+    runInterpreter(tiered, runtime);
+    return tiered.opsRun;
+}
+
+CompileResult bf::executeTiered(std::istream& input, CompilerState& out, void * tape)
+{
+    TieredProgram tiered;
+    tiered.out = &out;
+    tiered.opsRun = 0;
+
+    //Parse and optimize the program as usual
+    SourceLocation errorLocation;
+    CompileResult result = ir::parse(input, tiered.program, &errorLocation);
+
+    if(result == MISMATCHED_BRAKETS)
+        out.setErrorLocation(errorLocation);
+
+    if(result != OK)
+        return result;
+
+    ir::PassManager passes;
+    ir::addDefaultPasses(passes);
+    passes.run(tiered.program, out.getDumpOutput());
+
+    tiered.iterations.assign(tiered.program.size(), 0);
+    tiered.code.assign(tiered.program.size(), NULL);
+
+    //Run the interpreter for the cell size
+    Runtime& runtime = getRuntime();
+    runtime.tape = static_cast<uint8_t *>(tape);
+    runInterpreter(tiered, runtime);
+    return OK;
+}
@@ -0,0 +1,349 @@
+#include "BfIr.h"
+#include <istream>
+#include <ostream>
+#include <iomanip>
+#include <cstdint>
+#include <stack>
+#include <string>
+#include <vector>
+
+//SSE2 is used to find commands if the compiler can generate it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BF_PARSE_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+using namespace std;
+using namespace bf;
+using namespace bf::ir;
+
+//Size of the blocks the source is read in
+#define PARSE_BUFFER_SIZE (64 * 1024)
+
+//State of the parser between characters
+struct Parser
+{
+    //A loop which has not been closed yet
+    struct OpenLoop
+    {
+        uint32_t index;         // Index of the OP_LOOP_BEGIN
+        SourceLocation location;
+    };
+
+    Program * program;
+    vector<OpenLoop> loops;
+    uint32_t line;
+    uint32_t lineStart;         // Source position of the start of the line
+    SourceLocation error;
+
+    //Gets the location of a source position on the current line
+    SourceLocation locate(uint32_t sourcePos) const
+    {
+        SourceLocation location = { line, sourcePos - lineStart + 1 };
+        return location;
+    }
+
+    //Processes a character
+    // Returns false if it is a mismatched bracket
+    bool parse(char c, uint32_t sourcePos)
+    {
+        switch(c)
+        {
+        case '+':
+            program->push_back(Op(OP_ADD, 1, 0, sourcePos));
+            break;
+
+        case '-':
+            program->push_back(Op(OP_ADD, -1, 0, sourcePos));
+            break;
+
+        case '>':
+            program->push_back(Op(OP_MOVE, 1, 0, sourcePos));
+            break;
+
+        case '<':
+            program->push_back(Op(OP_MOVE, -1, 0, sourcePos));
+            break;
+
+        case '.':
+            program->push_back(Op(OP_OUTPUT, 0, 0, sourcePos));
+            break;
+
+        case ',':
+            program->push_back(Op(OP_INPUT, 0, 0, sourcePos));
+            break;
+
+        case '[':
+            {
+                OpenLoop loop = { static_cast<uint32_t>(program->size()), locate(sourcePos) };
+                loops.push_back(loop);
+                program->push_back(Op(OP_LOOP_BEGIN, 0, 0, sourcePos));
+                break;
+            }
+
+        case ']':
+            {
+                //Detect loop mismatch
+                if(loops.empty())
+                {
+                    error = locate(sourcePos);
+                    return false;
+                }
+
+                //Link both ends of the loop
+                uint32_t begin = loops.back().index;
+                loops.pop_back();
+
+                (*program)[begin].value = static_cast<int32_t>(program->size());
+                program->push_back(Op(OP_LOOP_END, begin, 0, sourcePos));
+                break;
+            }
+
+        case '\n':
+            line++;
+            lineStart = sourcePos + 1;
+            break;
+        }
+
+        return true;
+    }
+};
+
+#ifdef BF_PARSE_SSE2
+//Finds the commands and newlines in the 16 bytes at data
+// Returns a mask with a bit set for each one
+static uint32_t findCommands(char const * data)
+{
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data));
+
+    //'+' ',' '-' '.' are 0x2B - 0x2E (moved to the bottom of the signed range)
+    __m128i found = _mm_cmplt_epi8(_mm_add_epi8(bytes, _mm_set1_epi8(0x80 - 0x2B)),
+        _mm_set1_epi8(-0x80 + 4));
+
+    //'<' and '>' are 0x3C and 0x3E
+    found = _mm_or_si128(found, _mm_cmpeq_epi8(_mm_or_si128(bytes, _mm_set1_epi8(2)), _mm_set1_epi8('>')));
+    found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('[')));
+    found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8(']')));
+    found = _mm_or_si128(found, _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')));
+
+    return static_cast<uint32_t>(_mm_movemask_epi8(found));
+}
+
+//Gets the index of the lowest bit set in a (non-zero) mask
+static uint32_t lowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<uint32_t>(__builtin_ctz(mask));
+#endif
+}
+#endif
+
+//Parses a block of the source starting at the given source position
+// Returns false if there is a mismatched bracket
+static bool parseBlock(Parser& parser, char const * data, uint32_t count, uint32_t sourcePos)
+{
+    uint32_t i = 0;
+
+#ifdef BF_PARSE_SSE2
+    //Skip everything else 32 bytes at a time (comments are often most of the
+    // source)
+    for(; i + 32 <= count; i += 32)
+    {
+        uint32_t mask = findCommands(data + i) | (findCommands(data + i + 16) << 16);
+
+        for(; mask != 0; mask &= mask - 1)
+        {
+            uint32_t bit = lowestBit(mask);
+
+            if(!parser.parse(data[i + bit], sourcePos + i + bit))
+                return false;
+        }
+    }
+#endif
+
+    for(; i < count; i++)
+    {
+        if(!parser.parse(data[i], sourcePos + i))
+            return false;
+    }
+
+    return true;
+}
+
+CompileResult bf::ir::parse(std::istream& input, Program& program, SourceLocation * errorLocation)
+{
+    Parser parser;
+    parser.program = &program;
+    parser.line = 1;
+    parser.lineStart = 0;
+
+    uint32_t sourcePos = 0;
+    vector<char> buffer(PARSE_BUFFER_SIZE);
+    bool matched = true;
+
+    while(input && matched)
+    {
+        //Read the next block of the source
+        input.read(&buffer[0], PARSE_BUFFER_SIZE);
+        if(input.bad())
+            return IO_ERROR;
+
+        uint32_t count = static_cast<uint32_t>(input.gcount());
+        matched = parseBlock(parser, &buffer[0], count, sourcePos);
+        sourcePos += count;
+    }
+
+    //Ensure every loop was closed
+    if(matched && !parser.loops.empty())
+    {
+        parser.error = parser.loops.back().location;
+        matched = false;
+    }
+
+    if(matched)
+        return OK;
+
+    if(errorLocation != NULL)
+        *errorLocation = parser.error;
+
+    return MISMATCHED_BRAKETS;
+}
+
+void bf::ir::linkLoops(Program& program)
+{
+    stack<uint32_t> loopStack;
+
+    for(uint32_t i = 0; i < program.size(); i++)
+    {
+        if(program[i].type == OP_LOOP_BEGIN)
+        {
+            loopStack.push(i);
+        }
+        else if(program[i].type == OP_LOOP_END)
+        {
+            uint32_t begin = loopStack.top();
+            loopStack.pop();
+
+            program[begin].value = static_cast<int32_t>(i);
+            program[i].value = static_cast<int32_t>(begin);
+        }
+    }
+}
+
+//Gets the name of an operation type
+static char const * getOpName(OpType type)
+{
+    switch(type)
+    {
+    case OP_ADD:        return "add";
+    case OP_SET:        return "set";
+    case OP_MUL:        return "mul";
+    case OP_MOVE:       return "move";
+    case OP_SCAN:       return "scan";
+    case OP_LOOP_BEGIN: return "loop";
+    case OP_LOOP_END:   return "end";
+    case OP_OUTPUT:     return "output";
+    case OP_INPUT:      return "input";
+    }
+
+    return "?";
+}
+
+void bf::ir::dump(std::ostream& output, Program const& program)
+{
+    int depth = 0;
+
+    for(uint32_t i = 0; i < program.size(); i++)
+    {
+        Op const& op = program[i];
+
+        //Loop bodies are indented
+        if(op.type == OP_LOOP_END)
+            depth--;
+
+        output << setw(6) << i << " @" << setw(6) << left << op.sourcePos << right
+               << string(2 * depth + 1, ' ') << getOpName(op.type);
+
+        switch(op.type)
+        {
+        case OP_ADD:
+            output << " [" << op.offset << "] " << showpos << op.value << noshowpos;
+            break;
+
+        case OP_SET:
+            output << " [" << op.offset << "] " << op.value;
+            break;
+
+        case OP_MUL:
+            output << " [" << op.offset << "] += [" << op.srcOffset << "] * " << op.value;
+            break;
+
+        case OP_MOVE:
+        case OP_SCAN:
+            output << " " << showpos << op.value << noshowpos;
+            break;
+
+        case OP_LOOP_BEGIN:
+        case OP_LOOP_END:
+            output << " -> " << op.value;
+            break;
+
+        case OP_OUTPUT:
+        case OP_INPUT:
+            output << " [" << op.offset << "]";
+            break;
+        }
+
+        output << '\n';
+
+        if(op.type == OP_LOOP_BEGIN)
+            depth++;
+    }
+}
+
+void bf::ir::PassManager::add(char const * name, Pass pass)
+{
+    Entry entry = { name, pass };
+    passes_.push_back(entry);
+}
+
+void bf::ir::PassManager::run(Program& program, std::ostream * dumpOutput) const
+{
+    //Dump the original program
+    if(dumpOutput != NULL)
+    {
+        *dumpOutput << "; parsed (" << program.size() << " ops)\n";
+        dump(*dumpOutput, program);
+    }
+
+    for(size_t i = 0; i < passes_.size(); i++)
+    {
+        //Run pass and fixup loops
+        passes_[i].pass(program);
+        linkLoops(program);
+
+        //Dump the result
+        if(dumpOutput != NULL)
+        {
+            *dumpOutput << "; after " << passes_[i].name << " (" << program.size() << " ops)\n";
+            dump(*dumpOutput, program);
+        }
+    }
+}
+
+void bf::ir::addDefaultPasses(PassManager& manager)
+{
+    manager.add("peephole", peepholePass);
+    manager.add("loop-idiom", loopIdiomPass);
+    manager.add("peephole", peepholePass);
+    manager.add("offset", offsetPass);
+    manager.add("peephole", peepholePass);
+    manager.add("dead-code", deadCodePass);
+}
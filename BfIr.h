@@ -0,0 +1,139 @@
+#ifndef _BFIR_H
+#define _BFIR_H
+
+// Brainfuck Intermediate Representation
+//
+
+#include <istream>
+#include <ostream>
+#include <cstdint>
+#include <vector>
+#include "BfCompiler.h"
+
+// Largest offset (in cells) an operation can access from the pointer
+//  Movement which would give a larger offset is applied to the pointer
+//  first (see offsetPass).
+#define BF_MAX_OFFSET 16384
+
+namespace bf
+{
+    namespace ir
+    {
+        // The type of an operation
+        enum OpType
+        {
+            OP_ADD,                 // Adds value to the cell at offset
+            OP_SET,                 // Sets the cell at offset to value
+            OP_MUL,                 // Adds the cell at srcOffset multiplied by value to the cell at offset
+            OP_MOVE,                // Moves the pointer by value cells
+            OP_SCAN,                // Moves the pointer by value cells until the current cell is zero
+            OP_LOOP_BEGIN,          // Start of a loop (value = index of the OP_LOOP_END)
+            OP_LOOP_END,            // End of a loop (value = index of the OP_LOOP_BEGIN)
+            OP_OUTPUT,              // Outputs the cell at offset
+            OP_INPUT,               // Inputs a character into the cell at offset
+        };
+
+        // A single operation
+        struct Op
+        {
+            // Type of operation
+            OpType type;
+
+            // Offset (in cells) from the pointer of the cell operated on
+            std::int32_t offset;
+
+            // Operand (depends on type)
+            std::int32_t value;
+
+            // Offset (in cells) of the cell read by OP_MUL
+            std::int32_t srcOffset;
+
+            // Position in the source file this operation was generated from
+            std::uint32_t sourcePos;
+
+            // Creates a new operation
+            Op(OpType type, std::int32_t value = 0, std::int32_t offset = 0,
+                std::uint32_t sourcePos = 0)
+                : type(type), offset(offset), value(value), srcOffset(0), sourcePos(sourcePos)
+            {
+            }
+        };
+
+        // A program is a list of operations
+        typedef std::vector<Op> Program;
+
+        // Parses a brainfuck program into its intermediate representation
+        //  Only returns OK, IO_ERROR or MISMATCHED_BRAKETS. If errorLocation
+        //  is not NULL, the location of the mismatched bracket is stored in it.
+        CompileResult parse(std::istream& input, Program& program,
+            SourceLocation * errorLocation = NULL);
+
+        // Recalculates the values of loop operations so they point to each other
+        //  Must be called after adding or removing operations
+        void linkLoops(Program& program);
+
+        // Writes a human readable listing of the program
+        void dump(std::ostream& output, Program const& program);
+
+        // A pass which transforms a program
+        typedef void (*Pass)(Program& program);
+
+        // Runs a sequence of passes over a program
+        class PassManager
+        {
+        private:
+            struct Entry
+            {
+                char const * name;
+                Pass pass;
+            };
+
+            std::vector<Entry> passes_;
+
+        public:
+            // Adds a pass to the end of the pipeline
+            void add(char const * name, Pass pass);
+
+            // Runs all the passes on the given program
+            //  If dumpOutput is not NULL, the program is dumped after each pass
+            void run(Program& program, std::ostream * dumpOutput = NULL) const;
+        };
+
+        // Adds the standard optimization passes to the given pass manager
+        void addDefaultPasses(PassManager& manager);
+
+        // State of a program after running the start of it at compile time
+        struct Prefix
+        {
+            // Operation execution resumes at (the size of the program if all of it ran)
+            //  If inLoop is true, this is an OP_LOOP_BEGIN and execution
+            //  resumes at the start of an iteration of its body (the current
+            //  cell is not zero)
+            std::uint32_t resume;
+            bool inLoop;
+
+            std::int32_t pointer;               // Cell the pointer is at
+            std::vector<std::uint8_t> tape;     // Cells from cell 0 (trailing zero cells are left out)
+            std::vector<std::uint8_t> output;   // Output written so far
+            std::uint64_t steps;                // Operations run
+        };
+
+        // Runs the start of a program which does not depend on its input
+        //  The program is interpreted until it reaches an OP_INPUT, runs
+        //  maxSteps operations or finishes. It is then rolled back to the
+        //  last point the code can resume from (an operation outside any loop
+        //  or the start of a loop iteration). Nothing is run if the pointer
+        //  leaves the first 1MB of the tape.
+        //  Returns false if nothing was run
+        bool evaluatePrefix(Program const& program, std::uint8_t cellSize, std::uint64_t maxSteps,
+            Prefix& prefix);
+
+        // Passes
+        void peepholePass(Program& program);    // Merges adjacent operations
+        void loopIdiomPass(Program& program);   // Replaces common loops with simpler operations
+        void offsetPass(Program& program);      // Folds pointer movement into cell offsets (up to BF_MAX_OFFSET)
+        void deadCodePass(Program& program);    // Removes loops which never execute
+    }
+}
+
+#endif
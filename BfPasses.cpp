@@ -0,0 +1,296 @@
+#include "BfIr.h"
+#include <cstdint>
+#include <map>
+
+using namespace std;
+using namespace bf;
+using namespace bf::ir;
+
+// Optimization passes
+//
+
+void bf::ir::peepholePass(Program& program)
+{
+    Program result;
+    result.reserve(program.size());
+
+    for(uint32_t i = 0; i < program.size(); i++)
+    {
+        Op const& op = program[i];
+
+        if(op.type == OP_SET && !result.empty())
+        {
+            //A set overwrites any previous add or set
+            Op& last = result.back();
+
+            if((last.type == OP_ADD || last.type == OP_SET) && last.offset == op.offset)
+            {
+                last = op;
+                continue;
+            }
+        }
+        else if(op.type == OP_ADD && !result.empty())
+        {
+            //Adds can be merged into the previous set
+            Op& last = result.back();
+
+            if(last.type == OP_SET && last.offset == op.offset)
+            {
+                last.value += op.value;
+                continue;
+            }
+        }
+
+        if(op.type == OP_ADD || op.type == OP_MOVE)
+        {
+            //Merge with the previous operation if possible
+            if(!result.empty())
+            {
+                Op& last = result.back();
+
+                if(last.type == op.type && last.offset == op.offset)
+                {
+                    last.value += op.value;
+
+                    //Remove operations which cancelled out
+                    if(last.value == 0)
+                        result.pop_back();
+
+                    continue;
+                }
+            }
+
+            //Ignore "no times"
+            if(op.value == 0)
+                continue;
+        }
+
+        result.push_back(op);
+    }
+
+    program.swap(result);
+}
+
+//Returns true if an offset moved by pos cells is at most BF_MAX_OFFSET
+static bool offsetInRange(int32_t offset, int32_t pos)
+{
+    int64_t moved = static_cast<int64_t>(offset) + pos;
+    return moved >= -BF_MAX_OFFSET && moved <= BF_MAX_OFFSET;
+}
+
+//Tries to convert the loop starting at begin into a multiply loop
+// A multiply loop contains only adds and moves, has no net movement and
+// adds -1 or +1 to the current cell. Its targets must be in range of the
+// pointer.
+static bool convertMultiplyLoop(Program const& program, uint32_t begin, Program& result)
+{
+    uint32_t end = program[begin].value;
+    map<int32_t, int32_t> deltas;
+    int32_t pos = 0;
+
+    //Find the value added to every cell
+    for(uint32_t i = begin + 1; i < end; i++)
+    {
+        Op const& op = program[i];
+
+        if(op.type == OP_ADD && offsetInRange(op.offset, pos))
+            deltas[pos + op.offset] += op.value;
+        else if(op.type == OP_MOVE)
+            pos += op.value;
+        else
+            return false;
+    }
+
+    int32_t step = deltas[0];
+    if(pos != 0 || (step != 1 && step != -1))
+        return false;
+
+    //Each target gets the current cell times its delta added to it
+    // (the loop runs -cell times when counting upwards)
+    for(map<int32_t, int32_t>::const_iterator it = deltas.begin(); it != deltas.end(); ++it)
+    {
+        if(it->first != 0 && it->second != 0)
+        {
+            result.push_back(Op(OP_MUL, step < 0 ? it->second : -it->second,
+                it->first, program[begin].sourcePos));
+        }
+    }
+
+    result.push_back(Op(OP_SET, 0, 0, program[begin].sourcePos));
+    return true;
+}
+
+void bf::ir::loopIdiomPass(Program& program)
+{
+    Program result;
+    result.reserve(program.size());
+
+    for(uint32_t i = 0; i < program.size(); i++)
+    {
+        Op const& op = program[i];
+
+        if(op.type == OP_LOOP_BEGIN && op.value == static_cast<int32_t>(i) + 2)
+        {
+            Op const& body = program[i + 1];
+
+            //Clear loop ([-] or [+])
+            // Adding any odd number will eventually reach 0 for every cell size
+            if(body.type == OP_ADD && body.offset == 0 && (body.value & 1) != 0)
+            {
+                result.push_back(Op(OP_SET, 0, 0, op.sourcePos));
+                i += 2;
+                continue;
+            }
+
+            //Scan loop ([>] or [<<])
+            if(body.type == OP_MOVE)
+            {
+                result.push_back(Op(OP_SCAN, body.value, 0, op.sourcePos));
+                i += 2;
+                continue;
+            }
+        }
+
+        //Multiply loop
+        if(op.type == OP_LOOP_BEGIN && convertMultiplyLoop(program, i, result))
+        {
+            i = op.value;
+            continue;
+        }
+
+        result.push_back(op);
+    }
+
+    program.swap(result);
+}
+
+void bf::ir::offsetPass(Program& program)
+{
+    Program result;
+    result.reserve(program.size());
+
+    //Pointer movement not yet applied to the pointer register
+    int32_t pos = 0;
+    uint32_t moveSourcePos = 0;
+
+    for(uint32_t i = 0; i < program.size(); i++)
+    {
+        Op op = program[i];
+
+        switch(op.type)
+        {
+        case OP_MOVE:
+            //Delay movement
+            if(pos == 0)
+                moveSourcePos = op.sourcePos;
+
+            pos += op.value;
+            continue;
+
+        case OP_LOOP_BEGIN:
+        case OP_LOOP_END:
+        case OP_SCAN:
+            //The pointer must be correct at loop boundaries
+            if(pos != 0)
+                result.push_back(Op(OP_MOVE, pos, 0, moveSourcePos));
+
+            pos = 0;
+            break;
+
+        default:
+            //Far movement is applied first so cells are accessed near the pointer
+            if(!offsetInRange(op.offset, pos) || (op.type == OP_MUL && !offsetInRange(op.srcOffset, pos)))
+            {
+                result.push_back(Op(OP_MOVE, pos, 0, moveSourcePos));
+                pos = 0;
+            }
+
+            if(op.type == OP_MUL)
+                op.srcOffset += pos;
+
+            op.offset += pos;
+            break;
+        }
+
+        result.push_back(op);
+    }
+
+    //Movement at the end of the program can be dropped
+
+    program.swap(result);
+}
+
+void bf::ir::deadCodePass(Program& program)
+{
+    Program result;
+    result.reserve(program.size());
+
+    //The tape is zero when the program starts and the current cell is zero
+    // after every loop
+    bool tapeZero = true;
+    bool cellZero = true;
+
+    for(uint32_t i = 0; i < program.size(); i++)
+    {
+        Op const& op = program[i];
+
+        switch(op.type)
+        {
+        case OP_MUL:
+            //Multiply loops which can never be entered do nothing
+            if(tapeZero || (cellZero && op.srcOffset == 0))
+                continue;
+
+            tapeZero = false;
+            if(op.offset == 0)
+                cellZero = false;
+            break;
+
+        case OP_ADD:
+        case OP_INPUT:
+            tapeZero = false;
+            if(op.offset == 0)
+                cellZero = false;
+            break;
+
+        case OP_SET:
+            //Clearing a cell which is already zero does nothing
+            if(op.value == 0 && (tapeZero || (cellZero && op.offset == 0)))
+                continue;
+
+            if(op.value != 0)
+                tapeZero = false;
+            if(op.offset == 0)
+                cellZero = (op.value == 0);
+            break;
+
+        case OP_MOVE:
+            cellZero = tapeZero;
+            break;
+
+        case OP_LOOP_BEGIN:
+            //Skip loops which can never be entered
+            if(cellZero)
+            {
+                i = op.value;
+                continue;
+            }
+
+            tapeZero = false;
+            cellZero = false;
+            break;
+
+        case OP_LOOP_END:
+        case OP_SCAN:
+            cellZero = true;
+            break;
+
+        case OP_OUTPUT:
+            break;
+        }
+
+        result.push_back(op);
+    }
+
+    program.swap(result);
+}
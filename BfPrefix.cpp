@@ -0,0 +1,242 @@
+#include "BfIr.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace bf;
+using namespace bf::ir;
+
+// Compile time evaluation
+//  The start of a program which does not read any input does the same thing
+//  every time it runs, so the compiler runs it instead. Cells written since
+//  the last point the code can resume from are logged so the program can be
+//  rolled back to that point when evaluation stops.
+//
+
+//Most tape used by the evaluation (in bytes)
+#define MAX_TAPE_SIZE (1024 * 1024)
+
+//State of a program being evaluated
+template<typename Cell>
+struct Evaluation
+{
+    vector<Cell> tape;
+    vector<pair<uint32_t, Cell> > undo;     // Cells written since the checkpoint and their old values
+    vector<uint8_t> output;
+    int64_t ptr;
+
+    //Last point the code can resume from
+    uint32_t resume;
+    bool inLoop;
+    int64_t resumePtr;
+    size_t resumeOutput;
+    uint64_t resumeSteps;
+
+    //Returns true if a cell can be used
+    static bool valid(int64_t cell)
+    {
+        return cell >= 0 && cell < static_cast<int64_t>(MAX_TAPE_SIZE / sizeof(Cell));
+    }
+
+    Cell get(int64_t cell) const
+    {
+        return static_cast<size_t>(cell) < tape.size() ? tape[static_cast<size_t>(cell)] : 0;
+    }
+
+    void set(int64_t cell, Cell value)
+    {
+        size_t index = static_cast<size_t>(cell);
+
+        if(index >= tape.size())
+        {
+            //Grow the tape geometrically
+            size_t size = tape.size() * 2;
+            if(size <= index)
+                size = index + 1;
+
+            tape.resize(size, 0);
+        }
+
+        undo.push_back(make_pair(static_cast<uint32_t>(index), tape[index]));
+        tape[index] = value;
+    }
+
+    //Records that the code can resume from this point
+    void checkpoint(uint32_t op, bool loop, uint64_t steps)
+    {
+        resume = op;
+        inLoop = loop;
+        resumePtr = ptr;
+        resumeOutput = output.size();
+        resumeSteps = steps;
+        undo.clear();
+    }
+
+    //Undoes everything done since the checkpoint
+    void rollback()
+    {
+        for(size_t i = undo.size(); i > 0; i--)
+            tape[undo[i - 1].first] = undo[i - 1].second;
+
+        undo.clear();
+        output.resize(resumeOutput);
+        ptr = resumePtr;
+    }
+};
+
+//Evaluates a program using cells of the given type
+template<typename Cell>
+static void evaluate(Program const& program, uint64_t maxSteps, Prefix& prefix)
+{
+    Evaluation<Cell> state;
+    state.ptr = 0;
+    state.checkpoint(0, false, 0);
+
+    uint32_t depth = 0;
+    uint64_t steps = 0;
+    bool running = true;
+    bool tapeLimit = false;
+
+    for(uint32_t i = 0; running; i++)
+    {
+        //Operations outside any loop can always be resumed from
+        if(depth == 0)
+            state.checkpoint(i, false, steps);
+
+        if(i >= program.size() || steps >= maxSteps)
+            break;
+
+        Op const& op = program[i];
+        int64_t cell = state.ptr + op.offset;
+        steps++;
+
+        //Multiplications leave the target alone if their loop would not have run
+        if(op.type == OP_MUL && state.valid(state.ptr + op.srcOffset) && state.get(state.ptr + op.srcOffset) == 0)
+            continue;
+
+        if(!state.valid(cell))
+        {
+            tapeLimit = true;
+            break;
+        }
+
+        switch(op.type)
+        {
+        case OP_ADD:
+            state.set(cell, static_cast<Cell>(state.get(cell) + op.value));
+            break;
+
+        case OP_SET:
+            state.set(cell, static_cast<Cell>(op.value));
+            break;
+
+        case OP_MUL:
+            if(!state.valid(state.ptr + op.srcOffset))
+            {
+                tapeLimit = true;
+                running = false;
+                break;
+            }
+
+            state.set(cell, static_cast<Cell>(state.get(cell) + state.get(state.ptr + op.srcOffset) * op.value));
+            break;
+
+        case OP_MOVE:
+            state.ptr += op.value;
+            tapeLimit = !state.valid(state.ptr);
+            running = !tapeLimit;
+            break;
+
+        case OP_SCAN:
+            while(running && state.get(state.ptr) != 0)
+            {
+                state.ptr += op.value;
+                tapeLimit = !state.valid(state.ptr);
+                running = !tapeLimit && ++steps <= maxSteps;
+            }
+            break;
+
+        case OP_LOOP_BEGIN:
+            if(state.get(state.ptr) == 0)
+            {
+                i = op.value;
+            }
+            else
+            {
+                depth++;
+                state.checkpoint(i, true, steps);
+            }
+            break;
+
+        case OP_LOOP_END:
+            if(state.get(state.ptr) != 0)
+            {
+                i = op.value;
+                state.checkpoint(i, true, steps);
+            }
+            else
+            {
+                depth--;
+            }
+            break;
+
+        case OP_OUTPUT:
+            state.output.push_back(static_cast<uint8_t>(state.get(cell)));
+            break;
+
+        case OP_INPUT:
+            //Everything after this depends on the input
+            running = false;
+            break;
+        }
+    }
+
+    state.rollback();
+
+    //A program which ran off the end of the evaluation tape has usually
+    // filled all of it (as in +[>+]), so nothing is kept rather than making
+    // the code larger by the size of the tape
+    if(tapeLimit)
+    {
+        prefix.resume = 0;
+        prefix.inLoop = false;
+        prefix.pointer = 0;
+        prefix.output.clear();
+        prefix.tape.clear();
+        prefix.steps = 0;
+        return;
+    }
+
+    prefix.resume = state.resume;
+    prefix.inLoop = state.inLoop;
+    prefix.pointer = static_cast<int32_t>(state.ptr);
+    prefix.output.swap(state.output);
+    prefix.steps = state.resumeSteps;
+
+    //Leave out the zero cells at the end
+    size_t used = state.tape.size();
+    while(used > 0 && state.tape[used - 1] == 0)
+        used--;
+
+    prefix.tape.resize(used * sizeof(Cell));
+    if(used > 0)
+        memcpy(&prefix.tape[0], &state.tape[0], used * sizeof(Cell));
+}
+
+bool bf::ir::evaluatePrefix(Program const& program, std::uint8_t cellSize, std::uint64_t maxSteps,
+    Prefix& prefix)
+{
+    if(cellSize == 1)
+        evaluate<uint8_t>(program, maxSteps, prefix);
+    else if(cellSize == 2)
+        evaluate<uint16_t>(program, maxSteps, prefix);
+    else if(cellSize == 4)
+        evaluate<uint32_t>(program, maxSteps, prefix);
+    else
+        evaluate<uint64_t>(program, maxSteps, prefix);
+
+    return prefix.resume != 0 || prefix.inLoop;
+}
@@ -0,0 +1,301 @@
+#include "BfProfile.h"
+#include "BfRuntime.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#endif
+
+using namespace std;
+using namespace bf;
+
+// Loop profiler
+//
+
+//Number of loops listed in a report
+#define REPORT_LOOPS 20
+
+//Most samples kept (later samples are dropped)
+#define MAX_SAMPLES (1024 * 1024)
+
+//Time between samples (in microseconds)
+#define SAMPLE_INTERVAL 1000
+
+#ifdef __linux__
+//State used by the sampling signal handler
+// The handler only uses memory set up before the timer is started
+static char const * samplingCode = NULL;
+static size_t samplingCodeSize = 0;
+static uint32_t * samplingBuffer = NULL;
+static volatile size_t samplingCount = 0;
+static volatile uint64_t samplingOther = 0;
+static struct sigaction oldProfAction;
+
+//Records the code position interrupted by the profiling timer
+static void sampleHandler(int, siginfo_t *, void * context)
+{
+    ucontext_t * ucontext = static_cast<ucontext_t *>(context);
+
+#if defined(__x86_64__)
+    char const * pc = reinterpret_cast<char const *>(ucontext->uc_mcontext.gregs[REG_RIP]);
+#else
+    char const * pc = reinterpret_cast<char const *>(ucontext->uc_mcontext.gregs[REG_EIP]);
+#endif
+
+    size_t offset = static_cast<size_t>(pc - samplingCode);
+
+    if(pc >= samplingCode && offset < samplingCodeSize && samplingCount < MAX_SAMPLES)
+        samplingBuffer[samplingCount++] = static_cast<uint32_t>(offset);
+    else
+        samplingOther = samplingOther + 1;
+}
+#endif
+
+bf::Profile::Profile(Mode mode)
+    : mode_(mode), otherSamples_(0)
+{
+}
+
+bf::Profile::Mode bf::Profile::getMode() const
+{
+    return mode_;
+}
+
+std::uint32_t bf::Profile::addLoop(std::uint32_t sourceBegin, std::uint32_t sourceEnd, std::uint32_t codeBegin)
+{
+    map<uint32_t, uint32_t>::iterator it = loopIndexes_.find(sourceBegin);
+    if(it != loopIndexes_.end())
+    {
+        loops_[it->second].codeBegin = codeBegin;
+        return it->second;
+    }
+
+    Loop loop = { sourceBegin, sourceEnd, codeBegin, codeBegin };
+    uint32_t index = static_cast<uint32_t>(loops_.size());
+
+    loops_.push_back(loop);
+    loopIndexes_[sourceBegin] = index;
+    return index;
+}
+
+void bf::Profile::setLoopEnd(std::uint32_t sourceBegin, std::uint32_t codeEnd)
+{
+    map<uint32_t, uint32_t>::iterator it = loopIndexes_.find(sourceBegin);
+    if(it != loopIndexes_.end())
+        loops_[it->second].codeEnd = codeEnd;
+}
+
+std::uint64_t * bf::Profile::resetCounters()
+{
+    //Always return a valid pointer, even without any loops
+    counters_.assign(loops_.size() * 2 + 1, 0);
+    return &counters_[0];
+}
+
+bool bf::Profile::startSampling(void const * code, std::size_t codeSize)
+{
+#ifdef __linux__
+    if(samplingBuffer != NULL)
+        return false;
+
+    samples_.assign(MAX_SAMPLES, 0);
+    otherSamples_ = 0;
+
+    samplingCode = static_cast<char const *>(code);
+    samplingCodeSize = codeSize;
+    samplingBuffer = &samples_[0];
+    samplingCount = 0;
+    samplingOther = 0;
+
+    //Install the handler and start the timer
+    struct sigaction action;
+    action.sa_sigaction = sampleHandler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = SAMPLE_INTERVAL;
+    timer.it_value = timer.it_interval;
+
+    if(::sigaction(SIGPROF, &action, &oldProfAction) != 0)
+    {
+        samplingBuffer = NULL;
+        return false;
+    }
+
+    if(::setitimer(ITIMER_PROF, &timer, NULL) != 0)
+    {
+        ::sigaction(SIGPROF, &oldProfAction, NULL);
+        samplingBuffer = NULL;
+        return false;
+    }
+
+    return true;
+#else
+    (void) code;
+    (void) codeSize;
+    return false;
+#endif
+}
+
+void bf::Profile::stopSampling()
+{
+#ifdef __linux__
+    if(samplingBuffer == NULL || samplingBuffer != samples_.data())
+        return;
+
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    ::setitimer(ITIMER_PROF, &timer, NULL);
+    ::sigaction(SIGPROF, &oldProfAction, NULL);
+
+    samples_.resize(samplingCount);
+    otherSamples_ = samplingOther;
+    samplingBuffer = NULL;
+#endif
+}
+
+//Converts a source position to "line:column"
+static string getLineColumn(vector<uint32_t> const& lineStarts, uint32_t position)
+{
+    size_t line = upper_bound(lineStarts.begin(), lineStarts.end(), position) - lineStarts.begin();
+
+    char result[32];
+    sprintf(result, "%u:%u", static_cast<unsigned>(line),
+        static_cast<unsigned>(position - lineStarts[line - 1] + 1));
+    return result;
+}
+
+//A loop in a report
+struct ReportEntry
+{
+    uint32_t loop;
+    uint64_t primary;           // Value the loops are ranked by
+    uint64_t secondary;
+};
+
+static bool compareEntries(ReportEntry const& a, ReportEntry const& b)
+{
+    return a.primary > b.primary;
+}
+
+void bf::Profile::writeReport(std::ostream& output, std::string const& source) const
+{
+    //Find the start of each line
+    vector<uint32_t> lineStarts(1, 0);
+    for(uint32_t i = 0; i < source.size(); i++)
+    {
+        if(source[i] == '\n')
+            lineStarts.push_back(i + 1);
+    }
+
+    vector<ReportEntry> entries;
+    char line[160];
+    uint64_t total = 0;
+
+    if(mode_ == COUNT)
+    {
+        //Rank by iterations
+        for(uint32_t i = 0; i < loops_.size(); i++)
+        {
+            if(i * 2 + 1 < counters_.size())
+            {
+                ReportEntry entry = { i, counters_[i * 2 + 1], counters_[i * 2] };
+                entries.push_back(entry);
+            }
+        }
+
+        output << "Loop profile (counted)\n";
+        output << " rank       iterations          entries  source                     code\n";
+    }
+    else
+    {
+        //Samples in a loop's code are in that loop or one nested in it
+        vector<uint32_t> samples(samples_);
+        sort(samples.begin(), samples.end());
+
+        vector<uint64_t> inclusive(loops_.size());
+        for(uint32_t i = 0; i < loops_.size(); i++)
+        {
+            inclusive[i] = lower_bound(samples.begin(), samples.end(), loops_[i].codeEnd) -
+                lower_bound(samples.begin(), samples.end(), loops_[i].codeBegin);
+        }
+
+        //Take the samples of each loop's children from the loop
+        // (loops are added in code order so a loop's parent is before it)
+        vector<uint64_t> self(inclusive);
+        vector<uint32_t> parents;
+
+        for(uint32_t i = 0; i < loops_.size(); i++)
+        {
+            while(!parents.empty() && loops_[parents.back()].codeEnd <= loops_[i].codeBegin)
+                parents.pop_back();
+
+            if(!parents.empty())
+                self[parents.back()] -= inclusive[i];
+
+            parents.push_back(i);
+        }
+
+        for(uint32_t i = 0; i < loops_.size(); i++)
+        {
+            ReportEntry entry = { i, self[i], inclusive[i] };
+            entries.push_back(entry);
+        }
+
+        total = samples_.size() + otherSamples_;
+        output << "Loop profile (sampled, " << total << " samples, " <<
+            otherSamples_ << " outside the generated code)\n";
+        output << " rank   self %  total %  source                     code\n";
+    }
+
+    stable_sort(entries.begin(), entries.end(), compareEntries);
+
+    for(size_t i = 0; i < entries.size() && i < REPORT_LOOPS && entries[i].primary > 0; i++)
+    {
+        Loop const& loop = loops_[entries[i].loop];
+        string sourceRange = getLineColumn(lineStarts, loop.sourceBegin) + "-" +
+            getLineColumn(lineStarts, loop.sourceEnd);
+
+        if(mode_ == COUNT)
+        {
+            sprintf(line, "%5u %16llu %16llu  %-25s  0x%06x-0x%06x\n", static_cast<unsigned>(i + 1),
+                static_cast<unsigned long long>(entries[i].primary),
+                static_cast<unsigned long long>(entries[i].secondary),
+                sourceRange.c_str(), loop.codeBegin, loop.codeEnd);
+        }
+        else
+        {
+            sprintf(line, "%5u %7.2f%% %7.2f%%  %-25s  0x%06x-0x%06x\n", static_cast<unsigned>(i + 1),
+                100.0 * entries[i].primary / total, 100.0 * entries[i].secondary / total,
+                sourceRange.c_str(), loop.codeBegin, loop.codeEnd);
+        }
+
+        output << line;
+    }
+
+    output << flush;
+}
+
+bool bf::executeProfiled(void const * code, std::size_t codeSize, void * tape, Profile& profile)
+{
+    Runtime& runtime = getRuntime();
+    runtime.profileCounters = profile.resetCounters();
+
+    if(profile.getMode() == Profile::SAMPLE && !profile.startSampling(code, codeSize))
+        return false;
+
+    execute(code, tape, runtime);
+
+    profile.stopSampling();
+    runtime.profileCounters = NULL;
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef _BFPROFILE_H
+#define _BFPROFILE_H
+
+// Brainfuck Profiler
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace bf
+{
+    // Profile of the loops in a compiled program
+    //  The compiler records the source and code positions of every loop it
+    //  writes. Loops replaced by the loop idiom pass are part of the
+    //  surrounding code.
+    class Profile
+    {
+    public:
+        // How the profile is collected
+        enum Mode
+        {
+            COUNT,              // Each loop counts its entries and iterations
+            SAMPLE,             // The running code is sampled by a timer (no
+                                //  changes to the code, only on Linux)
+        };
+
+        // Information about a loop
+        struct Loop
+        {
+            std::uint32_t sourceBegin;      // Source position of the [
+            std::uint32_t sourceEnd;        // Source position of the ]
+            std::uint32_t codeBegin;        // Position of the code of the loop
+            std::uint32_t codeEnd;          // Position after the code of the loop
+        };
+
+    private:
+        Mode mode_;
+        std::vector<Loop> loops_;
+        std::map<std::uint32_t, std::uint32_t> loopIndexes_;   // Source position => loop
+
+        // Counters (entries and iterations of each loop)
+        std::vector<std::uint64_t> counters_;
+
+        // Sampled code positions
+        std::vector<std::uint32_t> samples_;
+        std::uint64_t otherSamples_;
+
+        // Profiles cannot be copied
+        Profile(Profile const&);
+        Profile& operator=(Profile const&);
+
+    public:
+        // Creates an empty profile
+        explicit Profile(Mode mode);
+
+        // Gets the way the profile is collected
+        Mode getMode() const;
+
+        // Adds a loop when it is compiled
+        //  If the loop was added before, its code position is replaced.
+        //  Returns the index of the loop (its counters are at index * 2)
+        std::uint32_t addLoop(std::uint32_t sourceBegin, std::uint32_t sourceEnd, std::uint32_t codeBegin);
+
+        // Sets the end of the code of the loop starting at sourceBegin
+        void setLoopEnd(std::uint32_t sourceBegin, std::uint32_t codeEnd);
+
+        // Zeros the counters and returns them for use by the code
+        std::uint64_t * resetCounters();
+
+        // Samples code running on this thread until stopSampling is called
+        //  Returns false if sampling is not supported or another profile is
+        //  being sampled
+        bool startSampling(void const * code, std::size_t codeSize);
+        void stopSampling();
+
+        // Writes a report of the hottest loops
+        //  source       = Source of the program (to find lines and columns)
+        void writeReport(std::ostream& output, std::string const& source) const;
+    };
+
+    // Executes code compiled with a profile, collecting the profile
+    //  Returns false if the profile could not be collected (the code is not run)
+    bool executeProfiled(void const * code, std::size_t codeSize, void * tape, Profile& profile);
+}
+
+#endif
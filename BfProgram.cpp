@@ -0,0 +1,447 @@
+#include "BfProgram.h"
+#include "BfRuntime.h"
+#include "BfTape.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <vector>
+
+using namespace std;
+using namespace bf;
+
+// Embeddable programs
+//
+
+//Size of the buffer output is collected in before being written
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+//Size of the buffer input is read into
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+//Most steps run between calls to checkBudget (so the time limit is checked)
+#define BUDGET_INTERVAL 65536
+
+//State of an ExecutionContext
+struct bf::ContextState
+{
+    Runtime runtime;
+    Tape tape;
+    bool tapeUsed;
+    bool volatile tapeFault;        // Set by the tape's fault handler
+
+    vector<uint8_t> outputBuffer;
+    vector<uint8_t> inputBuffer;
+
+    // Input (function or memory)
+    InputFunction input;
+    void * inputUser;
+    uint8_t const * inputData;
+    size_t inputSize;
+
+    // Output (function or memory)
+    OutputFunction output;
+    void * outputUser;
+    uint8_t * outputData;
+    size_t outputCapacity;
+    size_t outputSize;
+    bool outputTruncated;
+
+    // Budget
+    uint64_t stepLimit;
+    uint32_t timeLimit;
+    chrono::steady_clock::time_point deadline;
+    chrono::steady_clock::duration timeLeft;    // Time left when the run was suspended
+
+    // Time slice
+    uint32_t timeSlice;
+    chrono::steady_clock::time_point sliceEnd;
+
+    // Steps before the current part of the budget and its size
+    uint64_t steps;
+    uint64_t chunk;
+    RunStatus status;
+
+    explicit ContextState(size_t tapeSize)
+        : tape(tapeSize), tapeUsed(false), tapeFault(false),
+            outputBuffer(OUTPUT_BUFFER_SIZE), inputBuffer(INPUT_BUFFER_SIZE),
+            input(NULL), inputUser(NULL), inputData(NULL), inputSize(0),
+            output(NULL), outputUser(NULL), outputData(NULL), outputCapacity(0),
+            outputSize(0), outputTruncated(false),
+            stepLimit(0), timeLimit(0), timeSlice(0), steps(0), chunk(0), status(FINISHED)
+    {
+    }
+};
+
+//Gets the state of the context which owns a runtime
+static ContextState& getState(Runtime * runtime)
+{
+    return *static_cast<ContextState *>(runtime->context);
+}
+
+//Writes the contents of the output buffer to the output of the context
+static void BF_FASTCALL flushOutput(Runtime * runtime)
+{
+    ContextState& state = getState(runtime);
+    size_t size = runtime->outputPos - runtime->outputBuffer;
+
+    if(state.output != NULL)
+    {
+        state.output(state.outputUser, runtime->outputBuffer, size);
+    }
+    else if(runtime->outputBuffer == state.outputData)
+    {
+        //Output was written straight to memory until it ran out of space
+        state.outputSize = size;
+        runtime->outputBuffer = &state.outputBuffer[0];
+        runtime->outputEnd = runtime->outputBuffer + OUTPUT_BUFFER_SIZE;
+    }
+    else
+    {
+        //Copy as much as still fits
+        size_t space = state.outputCapacity - state.outputSize;
+        if(size > space)
+        {
+            size = space;
+            state.outputTruncated = true;
+        }
+
+        if(size > 0)
+        {
+            memcpy(state.outputData + state.outputSize, runtime->outputBuffer, size);
+            state.outputSize += size;
+        }
+    }
+
+    runtime->outputPos = runtime->outputBuffer;
+}
+
+//Reads the next input character from the input function of the context
+// Returns -1 on EOF
+static int BF_FASTCALL readInput(Runtime * runtime)
+{
+    ContextState& state = getState(runtime);
+
+    if(runtime->inputPos >= runtime->inputEnd)
+    {
+        if(runtime->inputEof || state.input == NULL)
+        {
+            runtime->inputEof = true;
+            return -1;
+        }
+
+        //Write any pending output first so prompts are seen
+        if(state.output != NULL)
+            flushOutput(runtime);
+
+        size_t count = state.input(state.inputUser, runtime->inputBuffer, INPUT_BUFFER_SIZE);
+        if(count == 0)
+        {
+            runtime->inputEof = true;
+            return -1;
+        }
+
+        runtime->inputPos = runtime->inputBuffer;
+        runtime->inputEnd = runtime->inputBuffer + count;
+    }
+
+    return *runtime->inputPos++;
+}
+
+//Starts the next part of the budget
+static void refillBudget(ContextState& state)
+{
+    state.chunk = BUDGET_INTERVAL;
+
+    //The step after the limit is the one which stops the program
+    if(state.stepLimit != 0 && state.stepLimit - state.steps < BUDGET_INTERVAL)
+        state.chunk = state.stepLimit - state.steps + 1;
+
+    state.runtime.budget = static_cast<intptr_t>(state.chunk);
+}
+
+//Called by the generated code when the budget runs out
+// Returns 0 to stop or suspend the program
+static int BF_FASTCALL checkBudget(Runtime * runtime)
+{
+    ContextState& state = getState(runtime);
+    chrono::steady_clock::time_point now;
+
+    if(state.timeLimit != 0 || state.timeSlice != 0)
+        now = chrono::steady_clock::now();
+
+    //The step which used up the budget has not run yet
+    if(state.stepLimit != 0 && state.steps + state.chunk > state.stepLimit)
+        state.status = STEP_LIMIT;
+    else if(state.timeLimit != 0 && now >= state.deadline)
+        state.status = TIME_LIMIT;
+
+    if(state.status != FINISHED)
+    {
+        flushOutput(runtime);
+        return 0;
+    }
+
+    state.steps += state.chunk;
+    refillBudget(state);
+
+    //The generated code continues with the step when it is resumed
+    if(state.timeSlice != 0 && now >= state.sliceEnd)
+    {
+        state.status = SUSPENDED;
+        state.timeLeft = state.deadline - now;
+
+        //Output written straight to memory stays there
+        if(runtime->outputBuffer == state.outputData)
+            state.outputSize = runtime->outputPos - runtime->outputBuffer;
+        else
+            flushOutput(runtime);
+
+        return 0;
+    }
+
+    return 1;
+}
+
+//Runs code until it finishes, stops or its time slice runs out
+// faultExit = code which stops the program after a tape fault (NULL to exit)
+static RunStatus runCode(void const * code, void * faultExit, ContextState& state)
+{
+    Runtime& runtime = state.runtime;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+
+    state.status = FINISHED;
+    state.deadline = now + state.timeLeft;
+    state.sliceEnd = now + chrono::microseconds(state.timeSlice);
+
+    state.tapeFault = false;
+    state.tape.setRecovery(faultExit, &state.tapeFault);
+    execute(code, runtime.tape, runtime);
+    state.tape.setRecovery(NULL, NULL);
+
+    //Count the steps in the last part of the budget
+    // (suspended programs have already counted them)
+    if(state.status == FINISHED || state.status == SUSPENDED)
+        state.steps += state.chunk - static_cast<uint64_t>(runtime.budget);
+    else
+        state.steps += state.chunk - 1;
+
+    //The code stops at the fault without writing its output
+    if(state.tapeFault)
+    {
+        flushOutput(&runtime);
+        state.status = TAPE_ERROR;
+    }
+
+    return state.status;
+}
+
+bf::ExecutionContext::ExecutionContext(std::size_t tapeSize)
+    : state_(new ContextState(tapeSize))
+{
+    Runtime& runtime = state_->runtime;
+    runtime.tape = NULL;
+    runtime.flushOutput = ::flushOutput;
+    runtime.readInput = ::readInput;
+    runtime.outputPos = NULL;
+    runtime.outputEnd = NULL;
+    runtime.outputBuffer = NULL;
+    runtime.inputPos = NULL;
+    runtime.inputEnd = NULL;
+    runtime.inputBuffer = &state_->inputBuffer[0];
+    runtime.compileStub = NULL;
+    runtime.compiler = NULL;
+    runtime.budget = 0;
+    runtime.checkBudget = ::checkBudget;
+    runtime.profileCounters = NULL;
+    runtime.resume = NULL;
+    runtime.inputEof = false;
+    runtime.inputStarted = false;
+    runtime.inputFd = -1;
+    runtime.output = NULL;
+    runtime.inputMapping = NULL;
+    runtime.inputMappingSize = 0;
+    runtime.context = state_;
+}
+
+bf::ExecutionContext::~ExecutionContext()
+{
+    delete state_;
+}
+
+bool bf::ExecutionContext::valid() const
+{
+    return state_->tape.valid();
+}
+
+void bf::ExecutionContext::setInput(InputFunction input, void * user)
+{
+    state_->input = input;
+    state_->inputUser = user;
+    state_->inputData = NULL;
+    state_->inputSize = 0;
+}
+
+void bf::ExecutionContext::setInput(void const * data, std::size_t size)
+{
+    state_->input = NULL;
+    state_->inputUser = NULL;
+    state_->inputData = static_cast<uint8_t const *>(data);
+    state_->inputSize = size;
+}
+
+void bf::ExecutionContext::setOutput(OutputFunction output, void * user)
+{
+    state_->output = output;
+    state_->outputUser = user;
+    state_->outputData = NULL;
+    state_->outputCapacity = 0;
+}
+
+void bf::ExecutionContext::setOutput(void * data, std::size_t capacity)
+{
+    state_->output = NULL;
+    state_->outputUser = NULL;
+    state_->outputData = static_cast<uint8_t *>(data);
+    state_->outputCapacity = capacity;
+}
+
+std::size_t bf::ExecutionContext::getOutputSize() const
+{
+    return state_->outputSize;
+}
+
+bool bf::ExecutionContext::outputTruncated() const
+{
+    return state_->outputTruncated;
+}
+
+void bf::ExecutionContext::setStepLimit(std::uint64_t steps)
+{
+    state_->stepLimit = steps;
+}
+
+void bf::ExecutionContext::setTimeLimit(std::uint32_t milliseconds)
+{
+    state_->timeLimit = milliseconds;
+}
+
+void bf::ExecutionContext::setTimeSlice(std::uint32_t microseconds)
+{
+    state_->timeSlice = microseconds;
+}
+
+std::uint64_t bf::ExecutionContext::getSteps() const
+{
+    return state_->steps;
+}
+
+bf::Program::Program(std::size_t maxCodeSize, std::uint8_t cellSize, EofCode eofCode)
+    : code_(maxCodeSize), state_(code_, cellSize, eofCode), compiled_(false)
+{
+    state_.setBudgetChecks(true);
+}
+
+CompileResult bf::Program::compile(std::istream& input)
+{
+    if(!code_.valid())
+        return OUT_OF_OUTPUT_SPACE;
+
+    //Replace the old code
+    if(compiled_)
+    {
+        compiled_ = false;
+        if(!code_.protectWritable())
+            return OUT_OF_OUTPUT_SPACE;
+
+        state_.reset();
+    }
+
+    CompileResult result = bf::compile(input, state_);
+
+    if(result == OK && !code_.protectExecutable())
+        result = OUT_OF_OUTPUT_SPACE;
+
+    compiled_ = (result == OK);
+    return result;
+}
+
+bool bf::Program::compiled() const
+{
+    return compiled_;
+}
+
+bf::SourceLocation const& bf::Program::getErrorLocation() const
+{
+    return state_.getErrorLocation();
+}
+
+void * bf::Program::getFaultExit() const
+{
+    if(state_.getFaultExit() == 0)
+        return NULL;
+
+    return state_.getAddress(state_.getFaultExit());
+}
+
+RunStatus bf::Program::run(ExecutionContext& context) const
+{
+    ContextState& state = *context.state_;
+    Runtime& runtime = state.runtime;
+
+    //Each run starts with an empty tape
+    if(state.tapeUsed)
+        state.tape.clear();
+
+    state.tapeUsed = true;
+
+    //Reset the input and output
+    if(state.inputData != NULL)
+    {
+        runtime.inputPos = const_cast<uint8_t *>(state.inputData);
+        runtime.inputEnd = runtime.inputPos + state.inputSize;
+    }
+    else
+    {
+        runtime.inputPos = runtime.inputBuffer;
+        runtime.inputEnd = runtime.inputBuffer;
+    }
+
+    runtime.inputEof = false;
+
+    //Output to memory is written there directly until it fills up
+    if(state.output == NULL && state.outputData != NULL)
+    {
+        runtime.outputBuffer = state.outputData;
+        runtime.outputEnd = state.outputData + state.outputCapacity;
+    }
+    else
+    {
+        runtime.outputBuffer = &state.outputBuffer[0];
+        runtime.outputEnd = runtime.outputBuffer + OUTPUT_BUFFER_SIZE;
+    }
+
+    runtime.outputPos = runtime.outputBuffer;
+    state.outputSize = 0;
+    state.outputTruncated = false;
+
+    //Start the budget
+    state.steps = 0;
+    state.timeLeft = chrono::milliseconds(state.timeLimit);
+    refillBudget(state);
+
+    runtime.tape = static_cast<uint8_t *>(state.tape.getStart());
+    runtime.resume = NULL;
+    return runCode(code_.getStart(), getFaultExit(), state);
+}
+
+RunStatus bf::Program::resume(ExecutionContext& context) const
+{
+    ContextState& state = *context.state_;
+
+    if(state.status != SUSPENDED)
+        return state.status;
+
+    return runCode(code_.getStart(), getFaultExit(), state);
+}
@@ -0,0 +1,147 @@
+#ifndef _BFPROGRAM_H
+#define _BFPROGRAM_H
+
+// Brainfuck Programs
+//  Interface for applications which embed the compiler. A program is compiled
+//  once and can then be run any number of times (on several threads at once
+//  if each thread uses its own ExecutionContext).
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include "BfCodeBuffer.h"
+#include "BfCompiler.h"
+
+namespace bf
+{
+    struct ContextState;
+
+    // Reads up to size bytes of input into buffer
+    //  Returns the number of bytes read (0 at the end of the input)
+    typedef std::size_t (* InputFunction)(void * user, std::uint8_t * buffer, std::size_t size);
+
+    // Writes size bytes of output
+    typedef void (* OutputFunction)(void * user, std::uint8_t const * data, std::size_t size);
+
+    // The reason a program stopped running
+    enum RunStatus
+    {
+        FINISHED,               // Ran to the end of the program
+        STEP_LIMIT,             // Ran out of steps
+        TIME_LIMIT,             // Ran out of time
+        SUSPENDED,              // Ran for its time slice (see Program::resume)
+        TAPE_ERROR,             // The pointer moved outside the tape
+                                //  (on other systems than Windows and Linux
+                                //  this prints an error and exits the process)
+    };
+
+    // Everything a program uses while it runs
+    //  The tape, input, output and budget are kept between runs (the tape is
+    //  cleared at the start of each run). A step is one iteration of a loop.
+    class ExecutionContext
+    {
+    private:
+        ContextState * state_;
+
+        // ExecutionContexts cannot be copied
+        ExecutionContext(ExecutionContext const&);
+        ExecutionContext& operator=(ExecutionContext const&);
+
+        friend class Program;
+
+    public:
+        // Creates a context with a tape of the given maximum size (in bytes)
+        //  The context has no input, discards its output and has no budget
+        explicit ExecutionContext(std::size_t tapeSize);
+        ~ExecutionContext();
+
+        // Returns true if the tape was allocated successfully
+        bool valid() const;
+
+        // Reads input using a function
+        void setInput(InputFunction input, void * user);
+
+        // Reads input from memory (which must remain valid while programs run)
+        void setInput(void const * data, std::size_t size);
+
+        // Writes output using a function
+        void setOutput(OutputFunction output, void * user);
+
+        // Writes output to memory
+        //  Output which does not fit is discarded (see getOutputSize)
+        void setOutput(void * data, std::size_t capacity);
+
+        // Gets the number of bytes written to the output memory by the last run
+        std::size_t getOutputSize() const;
+
+        // Returns true if the last run produced more output than fitted in
+        // the output memory
+        bool outputTruncated() const;
+
+        // Sets the maximum number of steps in a run (0 for no limit)
+        void setStepLimit(std::uint64_t steps);
+
+        // Sets the maximum time a run can take in milliseconds (0 for no limit)
+        //  The time is only checked every few thousand steps
+        void setTimeLimit(std::uint32_t milliseconds);
+
+        // Sets how long a run goes on before it is suspended in microseconds
+        //  (0, the default, never suspends runs). Like the time limit, this
+        //  is only checked every few thousand steps. Time spent suspended
+        //  does not count towards the time limit.
+        void setTimeSlice(std::uint32_t microseconds);
+
+        // Gets the number of steps run by the last run
+        std::uint64_t getSteps() const;
+    };
+
+    // A compiled program which owns its code
+    //  Loops check the budget of the context they are run in, so programs
+    //  with a budget can be stopped at any loop (or suspended there and
+    //  resumed later, see ExecutionContext::setTimeSlice).
+    class Program
+    {
+    private:
+        CodeBuffer code_;
+        CompilerState state_;
+        bool compiled_;
+
+        // Programs cannot be copied
+        Program(Program const&);
+        Program& operator=(Program const&);
+
+        // Gets the code which stops the program after a tape fault
+        void * getFaultExit() const;
+
+    public:
+        // Creates an empty program with the given options
+        //  maxCodeSize  = Maximum size of the compiled code (in bytes)
+        //  cellSize     = Size of cells to use (must be 1, 2 or 4, or 8 in x86-64)
+        //  eofCode      = What code to produce on EOF (see bf::EofCode)
+        explicit Program(std::size_t maxCodeSize,
+            std::uint8_t cellSize = 1, EofCode eofCode = EofCode(-1));
+
+        // Compiles the program, replacing any previously compiled code
+        //  Must not be called while the program is running
+        CompileResult compile(std::istream& input);
+
+        // Returns true if the program has been compiled successfully
+        bool compiled() const;
+
+        // Gets the location of the mismatched bracket if compile returned
+        //  MISMATCHED_BRAKETS
+        SourceLocation const& getErrorLocation() const;
+
+        // Runs the program with the given context
+        //  The program must have been compiled
+        RunStatus run(ExecutionContext& context) const;
+
+        // Continues a run which returned SUSPENDED from where it stopped
+        //  The tape, input, output and budget are carried on from before.
+        //  Returns the status of the last run if it was not suspended.
+        RunStatus resume(ExecutionContext& context) const;
+    };
+}
+
+#endif
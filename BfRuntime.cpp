@@ -0,0 +1,234 @@
+#include "BfCompiler.h"
+#include "BfRuntime.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+using namespace std;
+using namespace bf;
+
+//Size of the buffer output is collected in before being written
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+//Size of the buffer input is read into
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+bool bf::writeFile(int fd, void const * data, std::size_t size)
+{
+    uint8_t const * pos = static_cast<uint8_t const *>(data);
+    uint8_t const * end = pos + size;
+
+    while(pos < end)
+    {
+#ifdef _WIN32
+        int written = ::_write(fd, pos, static_cast<unsigned>(end - pos));
+#else
+        ssize_t written = ::write(fd, pos, end - pos);
+        if(written < 0 && errno == EINTR)
+            continue;
+#endif
+
+        if(written <= 0)
+            return false;
+
+        pos += written;
+    }
+
+    return true;
+}
+
+//Writes the contents of the output buffer to stdout (or the output string)
+static void BF_FASTCALL flushOutput(Runtime * runtime)
+{
+    size_t size = runtime->outputPos - runtime->outputBuffer;
+
+    //Give up on errors (like cout does)
+    if(runtime->output != NULL)
+        runtime->output->append(reinterpret_cast<char *>(runtime->outputBuffer), size);
+    else
+        writeFile(1, runtime->outputBuffer, size);
+
+    runtime->outputPos = runtime->outputBuffer;
+}
+
+//Maps the rest of the input into memory if it is a regular file
+// Returns false if the input cannot be mapped
+static bool mapInput(Runtime * runtime)
+{
+#ifdef _WIN32
+    (void) runtime;
+    return false;
+#else
+    int fd = runtime->inputFd;
+
+    //Find the part of the file not yet read
+    struct stat info;
+    if(::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+        return false;
+
+    off_t start = ::lseek(fd, 0, SEEK_CUR);
+    if(start < 0 || start >= info.st_size)
+        return false;
+
+    //Mappings must start on a page boundary
+    off_t alignedStart = start & ~static_cast<off_t>(::sysconf(_SC_PAGESIZE) - 1);
+    size_t length = static_cast<size_t>(info.st_size - alignedStart);
+
+    void * mapping = ::mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, alignedStart);
+    if(mapping == MAP_FAILED)
+        return false;
+
+    //Consume the file so later reads hit EOF
+    ::lseek(fd, info.st_size, SEEK_SET);
+
+    runtime->inputMapping = static_cast<uint8_t *>(mapping);
+    runtime->inputMappingSize = length;
+    runtime->inputPos = static_cast<uint8_t *>(mapping) + (start - alignedStart);
+    runtime->inputEnd = static_cast<uint8_t *>(mapping) + length;
+    return true;
+#endif
+}
+
+//Unmaps the input mapped by mapInput
+static void unmapInput(Runtime * runtime)
+{
+#ifndef _WIN32
+    if(runtime->inputMapping != NULL)
+        ::munmap(runtime->inputMapping, runtime->inputMappingSize);
+#endif
+
+    runtime->inputMapping = NULL;
+    runtime->inputMappingSize = 0;
+}
+
+//Reads the next input character, refilling the input buffer
+// Returns -1 on EOF
+static int BF_FASTCALL readInput(Runtime * runtime)
+{
+    if(runtime->inputPos >= runtime->inputEnd)
+    {
+        if(runtime->inputEof)
+            return -1;
+
+        //Write any pending output first so prompts are displayed
+        flushOutput(runtime);
+
+        if(runtime->inputStarted || !mapInput(runtime))
+        {
+            //Read the next block of input
+            int count;
+
+            do
+            {
+#ifdef _WIN32
+                count = ::_read(runtime->inputFd, runtime->inputBuffer, INPUT_BUFFER_SIZE);
+            }
+            while(false);
+#else
+                count = static_cast<int>(::read(runtime->inputFd, runtime->inputBuffer, INPUT_BUFFER_SIZE));
+            }
+            while(count < 0 && errno == EINTR);
+#endif
+
+            if(count <= 0)
+            {
+                runtime->inputEof = true;
+                return -1;
+            }
+
+            runtime->inputPos = runtime->inputBuffer;
+            runtime->inputEnd = runtime->inputBuffer + count;
+        }
+
+        runtime->inputStarted = true;
+    }
+
+    return *runtime->inputPos++;
+}
+
+//Refills the budget of a runtime without a step or time limit
+static int BF_FASTCALL checkBudget(Runtime * runtime)
+{
+    runtime->budget = INTPTR_MAX;
+    return 1;
+}
+
+bf::FileRuntime::FileRuntime()
+    : outputBuffer_(OUTPUT_BUFFER_SIZE), inputBuffer_(INPUT_BUFFER_SIZE)
+{
+    runtime_.tape = NULL;
+    runtime_.flushOutput = ::flushOutput;
+    runtime_.readInput = ::readInput;
+    runtime_.outputBuffer = &outputBuffer_[0];
+    runtime_.outputEnd = runtime_.outputBuffer + OUTPUT_BUFFER_SIZE;
+    runtime_.inputBuffer = &inputBuffer_[0];
+    runtime_.compileStub = NULL;
+    runtime_.compiler = NULL;
+    runtime_.budget = INTPTR_MAX;
+    runtime_.checkBudget = ::checkBudget;
+    runtime_.profileCounters = NULL;
+    runtime_.resume = NULL;
+    runtime_.inputMapping = NULL;
+    runtime_.inputMappingSize = 0;
+    runtime_.context = this;
+
+    reset(0, NULL);
+}
+
+bf::FileRuntime::~FileRuntime()
+{
+    unmapInput(&runtime_);
+}
+
+void bf::FileRuntime::reset(int inputFd, std::string * output)
+{
+    unmapInput(&runtime_);
+
+    runtime_.outputPos = runtime_.outputBuffer;
+    runtime_.inputPos = runtime_.inputBuffer;
+    runtime_.inputEnd = runtime_.inputBuffer;
+    runtime_.inputEof = false;
+    runtime_.inputStarted = false;
+    runtime_.inputFd = inputFd;
+    runtime_.output = output;
+}
+
+bf::Runtime& bf::FileRuntime::get()
+{
+    return runtime_;
+}
+
+static FileRuntime stdRuntime;
+
+bf::Runtime& bf::getRuntime()
+{
+    return stdRuntime.get();
+}
+
+void bf::execute(void const * code, void * tape)
+{
+    execute(code, tape, stdRuntime.get());
+}
+
+void bf::execute(void const * code, void * tape, Runtime& runtime)
+{
+    runtime.tape = static_cast<uint8_t *>(tape);
+    reinterpret_cast<EntryPoint>(const_cast<void *>(code))(&runtime);
+}
+
+void bf::executeWithStubs(void const * code, void * tape, StubCompiler compileStub, void * compiler)
+{
+    Runtime& runtime = stdRuntime.get();
+    runtime.compileStub = compileStub;
+    runtime.compiler = compiler;
+    execute(code, tape, runtime);
+}
@@ -0,0 +1,147 @@
+#ifndef _BFRUNTIME_H
+#define _BFRUNTIME_H
+
+// Brainfuck Runtime Support
+//  Internal header shared between the compiler and the runtime functions
+//
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "BfCompiler.h"
+#include "BfIr.h"
+
+// Calling convention of the runtime functions and the generated code
+//  On x86-64 the System V convention is always used (first argument in edi)
+#if defined(_MSC_VER)
+#define BF_FASTCALL __fastcall
+#elif defined(__i386__)
+#define BF_FASTCALL __attribute__((fastcall))
+#else
+#define BF_FASTCALL
+#endif
+
+// Size of the unmapped guard regions before and after the tape
+//  The generated code tests the pointer after moving it at most half of
+//  this and only accesses cells within BF_MAX_OFFSET cells of it, so
+//  leaving the tape always faults in a guard region.
+#define BF_GUARD_SIZE (1024 * 1024)
+
+namespace bf
+{
+    // State shared between the generated code and the runtime functions
+    //  The generated code is passed a pointer to this which it keeps in esi
+    //  (r12 in x86-64) and it keeps the current output position in edi (r13
+    //  in x86-64). The code contains no absolute addresses so everything it
+    //  uses outside the tape is reached through this structure.
+    //  Fields used by the generated code must be pointer sized.
+    struct Runtime
+    {
+        std::uint8_t * tape;            // Address of the first cell
+
+        // Runtime functions
+        void (BF_FASTCALL * flushOutput)(Runtime * runtime);
+        int (BF_FASTCALL * readInput)(Runtime * runtime);
+
+        std::uint8_t * outputPos;       // Output position (only updated around calls)
+        std::uint8_t * outputEnd;       // End of the output buffer
+        std::uint8_t * outputBuffer;    // Start of the output buffer
+
+        std::uint8_t * inputPos;        // Next input byte
+        std::uint8_t * inputEnd;        // End of the input available
+        std::uint8_t * inputBuffer;     // Buffer input is read into
+
+        // Compiles the code for a lazy stub, returning the address to jump to
+        void * (BF_FASTCALL * compileStub)(Runtime * runtime, std::uint32_t stub);
+        void * compiler;                // Compiler state used by compileStub
+
+        // Loop iterations left before checkBudget is called (see CompilerState::setBudgetChecks)
+        std::intptr_t budget;
+
+        // Called when the budget runs out, returns 0 to stop the program
+        //  This must refill the budget to let the program continue
+        int (BF_FASTCALL * checkBudget)(Runtime * runtime);
+
+        // Counters incremented by code compiled with a counting Profile
+        std::uint64_t * profileCounters;
+
+        // Code to continue from the next time the program is entered (NULL to start it)
+        //  Set when checkBudget stops a program compiled with budget checks
+        //  (the pointer is then stored in tape).
+        void * resume;
+
+        bool inputEof;                  // True once the end of the input is reached
+        bool inputStarted;              // True once input has been read for the first time
+
+        int inputFd;                    // File descriptor input is read from
+        std::string * output;           // String output is appended to (NULL to write to stdout)
+
+        std::uint8_t * inputMapping;    // Input file mapped by readInput (if any)
+        std::size_t inputMappingSize;
+
+        void * context;                 // Owner of the runtime (used by its runtime functions)
+    };
+
+    // A Runtime with its own buffers
+    //  Code can be run on several threads at once if each thread uses its own
+    //  FileRuntime (and tape).
+    class FileRuntime
+    {
+    private:
+        Runtime runtime_;
+        std::vector<std::uint8_t> outputBuffer_;
+        std::vector<std::uint8_t> inputBuffer_;
+
+        // FileRuntimes cannot be copied
+        FileRuntime(FileRuntime const&);
+        FileRuntime& operator=(FileRuntime const&);
+
+    public:
+        // Creates a runtime reading from stdin and writing to stdout
+        FileRuntime();
+        ~FileRuntime();
+
+        // Prepares the runtime for a new run
+        //  inputFd      = File descriptor to read input from
+        //  output       = String to append output to (NULL to write to stdout)
+        void reset(int inputFd, std::string * output);
+
+        // Gets the Runtime passed to the generated code
+        Runtime& get();
+    };
+
+    // Writes data to a file descriptor, retrying partial writes
+    //  Returns false on errors
+    bool writeFile(int fd, void const * data, std::size_t size);
+
+    // Entry point of the generated code
+    typedef void (BF_FASTCALL * EntryPoint)(Runtime * runtime);
+
+    // Function which compiles the code for lazy stubs
+    typedef void * (BF_FASTCALL * StubCompiler)(Runtime * runtime, std::uint32_t stub);
+
+    // Gets the Runtime used for stdin and stdout
+    Runtime& getRuntime();
+
+    // Writes a function which runs the loop starting at the given operation
+    //  The function is called like the entry point with runtime->tape pointing
+    //  to the current cell. It leaves its output in the output buffer and
+    //  stores the final pointer in runtime->tape.
+    //  Returns false if there is not enough space for the function
+    bool writeLoopFunction(CompilerState& out, ir::Program const& program, std::uint32_t begin);
+
+    // Interprets a program without compiling any of it
+    //  runtime->tape must point to the first cell. The output is flushed.
+    //  Returns the number of operations run
+    std::uint64_t interpret(ir::Program const& program, CompilerState& out, Runtime& runtime);
+
+    // Executes code using the given runtime
+    void execute(void const * code, void * tape, Runtime& runtime);
+
+    // Executes code containing lazy stubs
+    //  compiler is stored in the Runtime for use by compileStub
+    void executeWithStubs(void const * code, void * tape, StubCompiler compileStub, void * compiler);
+}
+
+#endif
@@ -0,0 +1,135 @@
+#include "BfScheduler.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace bf;
+
+// Scheduler
+//  The tasks are kept in one queue. Workers take a task from the front, run
+//  it until it finishes or is suspended and put suspended tasks on the back.
+//
+
+//A program waiting for its turn
+struct Task
+{
+    Program const * program;
+    ExecutionContext * context;
+    CompletionFunction done;
+    void * user;
+    bool started;           // True once the task has been suspended
+};
+
+//State shared by all the threads
+struct bf::SchedulerState
+{
+    deque<Task> tasks;
+    size_t unfinished;      // Tasks added which have not finished
+    bool stopping;
+
+    mutex lock;
+    condition_variable taskAdded;
+    condition_variable taskDone;
+
+    vector<thread> workers;
+};
+
+//Runs tasks until the scheduler stops
+static void worker(SchedulerState& state)
+{
+    unique_lock<mutex> lock(state.lock);
+
+    for(;;)
+    {
+        while(state.tasks.empty() && !state.stopping)
+            state.taskAdded.wait(lock);
+
+        if(state.tasks.empty())
+            return;
+
+        Task task = state.tasks.front();
+        state.tasks.pop_front();
+        lock.unlock();
+
+        RunStatus status;
+        if(task.started)
+            status = task.program->resume(*task.context);
+        else
+            status = task.program->run(*task.context);
+
+        if(status == SUSPENDED)
+        {
+            //Wait for another turn
+            task.started = true;
+
+            lock.lock();
+            state.tasks.push_back(task);
+            state.taskAdded.notify_one();
+            continue;
+        }
+
+        if(task.done != NULL)
+            task.done(task.user, status);
+
+        lock.lock();
+        if(--state.unfinished == 0)
+            state.taskDone.notify_all();
+    }
+}
+
+bf::Scheduler::Scheduler(unsigned threads)
+    : state_(new SchedulerState())
+{
+    if(threads == 0)
+        threads = thread::hardware_concurrency();
+    if(threads == 0)
+        threads = 1;
+
+    state_->unfinished = 0;
+    state_->stopping = false;
+
+    for(unsigned i = 0; i < threads; i++)
+        state_->workers.push_back(thread(worker, ref(*state_)));
+}
+
+bf::Scheduler::~Scheduler()
+{
+    wait();
+
+    {
+        lock_guard<mutex> lock(state_->lock);
+        state_->stopping = true;
+        state_->taskAdded.notify_all();
+    }
+
+    for(size_t i = 0; i < state_->workers.size(); i++)
+        state_->workers[i].join();
+
+    delete state_;
+}
+
+void bf::Scheduler::add(Program const& program, ExecutionContext& context, std::uint32_t timeSlice,
+    CompletionFunction done, void * user)
+{
+    context.setTimeSlice(timeSlice);
+
+    Task task = { &program, &context, done, user, false };
+
+    lock_guard<mutex> lock(state_->lock);
+    state_->tasks.push_back(task);
+    state_->unfinished++;
+    state_->taskAdded.notify_one();
+}
+
+void bf::Scheduler::wait()
+{
+    unique_lock<mutex> lock(state_->lock);
+
+    while(state_->unfinished != 0)
+        state_->taskDone.wait(lock);
+}
@@ -0,0 +1,56 @@
+#ifndef _BFSCHEDULER_H
+#define _BFSCHEDULER_H
+
+// Brainfuck Scheduler
+//
+
+#include <cstdint>
+#include "BfProgram.h"
+
+namespace bf
+{
+    struct SchedulerState;
+
+    // Called on a worker thread when a task finishes
+    typedef void (* CompletionFunction)(void * user, RunStatus status);
+
+    // Runs many programs at once on a fixed number of threads
+    //  Tasks take turns in the order they were added. Each one runs for its
+    //  time slice and is then suspended and put at the back of the queue, so
+    //  long running programs cannot hold up the others. Suspended tasks only
+    //  keep their ExecutionContext, so there can be many more tasks than threads.
+    class Scheduler
+    {
+    private:
+        SchedulerState * state_;
+
+        // Schedulers cannot be copied
+        Scheduler(Scheduler const&);
+        Scheduler& operator=(Scheduler const&);
+
+    public:
+        // Starts the worker threads
+        //  threads      = Number of threads to use (0 for one per processor)
+        explicit Scheduler(unsigned threads = 0);
+
+        // Waits for the tasks to finish and stops the threads
+        ~Scheduler();
+
+        // Adds a task which runs a program with a context
+        //  The program and context must not be used for anything else until
+        //  the task finishes (the context's time slice is replaced).
+        //  program      = Program to run (must have been compiled)
+        //  context      = Context to run it with
+        //  timeSlice    = Time the task runs before the next one gets a turn
+        //                  (in microseconds, 0 to run it to the end)
+        //  done         = Function called when the task finishes (may be NULL)
+        //  user         = Value passed to done
+        void add(Program const& program, ExecutionContext& context, std::uint32_t timeSlice,
+            CompletionFunction done = NULL, void * user = NULL);
+
+        // Waits until every task added so far has finished
+        void wait();
+    };
+}
+
+#endif
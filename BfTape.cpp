@@ -0,0 +1,330 @@
+#include "BfTape.h"
+#include "BfRuntime.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <cstdio>
+#else
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <ucontext.h>
+#endif
+
+using namespace bf;
+
+// Tape memory management
+//
+
+//Amount of memory committed by each fault
+#define COMMIT_SIZE (64 * 1024)
+
+//Maximum number of tapes which can exist at once
+#define MAX_TAPES 4096
+
+//Range of memory used by a tape
+// The fault handler reads these without locking so ranges are published by
+// setting end last and removed by clearing end first
+struct TapeRange
+{
+    char * volatile start;
+    char * volatile end;
+
+    //Code to continue at after the pointer leaves the tape (see Tape::setRecovery)
+    void * volatile recovery;
+    bool volatile * volatile faulted;
+};
+
+static TapeRange tapeRanges[MAX_TAPES];
+static std::mutex tapeRangesMutex;
+static bool handlerInstalled = false;
+
+//Prints a fatal error from the fault handler and exits
+static void fatalError(char const * message)
+{
+#ifdef _WIN32
+    std::fputs(message, stderr);
+    ::ExitProcess(1);
+#else
+    //Only async-signal-safe functions can be used here
+    ssize_t ignored = ::write(2, message, std::strlen(message));
+    (void) ignored;
+    ::_exit(1);
+#endif
+}
+
+//Commits the block of memory containing the given address
+static bool commitBlock(TapeRange const& range, char * address)
+{
+    char * block = range.start + ((address - range.start) & ~static_cast<std::ptrdiff_t>(COMMIT_SIZE - 1));
+    std::size_t size = COMMIT_SIZE;
+
+    if(static_cast<std::size_t>(range.end - block) < size)
+        size = range.end - block;
+
+#ifdef _WIN32
+    return ::VirtualAlloc(block, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+    return ::mprotect(block, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+//Stops the code using a tape after the pointer left it
+// Returns the address to continue at (exits if there is nowhere to go)
+static void * recoverFault(TapeRange const& range, char const * message)
+{
+    void * recovery = range.recovery;
+    bool volatile * faulted = range.faulted;
+
+    if(recovery == NULL || faulted == NULL)
+        fatalError(message);
+
+    *faulted = true;
+    return recovery;
+}
+
+//Handles a fault at the given address
+// recovery is set to the code to continue at (NULL to run the faulting
+// instruction again)
+// Returns false if the address is not part of any tape
+static bool handleFault(char * address, void *& recovery)
+{
+    recovery = NULL;
+
+    for(int i = 0; i < MAX_TAPES; i++)
+    {
+        char * start = tapeRanges[i].start;
+        char * end = tapeRanges[i].end;
+
+        if(end == NULL || address < start - BF_GUARD_SIZE || address >= end + BF_GUARD_SIZE)
+            continue;
+
+        if(address < start)
+            recovery = recoverFault(tapeRanges[i], "Tape underflow: the pointer moved before the start of the tape\n");
+        else if(address >= end)
+            recovery = recoverFault(tapeRanges[i], "Tape overflow: the pointer moved past the end of the tape\n");
+        else if(!commitBlock(tapeRanges[i], address))
+            fatalError("Out of memory while growing the tape\n");
+
+        return true;
+    }
+
+    return false;
+}
+
+#ifdef _WIN32
+
+//Vectored exception handler for tape faults
+static LONG CALLBACK tapeExceptionHandler(PEXCEPTION_POINTERS info)
+{
+    PEXCEPTION_RECORD record = info->ExceptionRecord;
+    void * recovery;
+
+    if(record->ExceptionCode == EXCEPTION_ACCESS_VIOLATION && record->NumberParameters >= 2 &&
+        handleFault(reinterpret_cast<char *>(record->ExceptionInformation[1]), recovery))
+    {
+        if(recovery != NULL)
+        {
+#ifdef _WIN64
+            info->ContextRecord->Rip = reinterpret_cast<DWORD64>(recovery);
+#else
+            info->ContextRecord->Eip = reinterpret_cast<DWORD>(recovery);
+#endif
+        }
+
+        return EXCEPTION_CONTINUE_EXECUTION;
+    }
+
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void installHandler()
+{
+    ::AddVectoredExceptionHandler(1, tapeExceptionHandler);
+}
+
+#else
+
+static struct sigaction previousAction;
+
+//SIGSEGV handler for tape faults
+static void tapeSignalHandler(int signal, siginfo_t * info, void * context)
+{
+    void * recovery;
+
+    if(handleFault(static_cast<char *>(info->si_addr), recovery))
+    {
+#ifdef __linux__
+        if(recovery != NULL)
+        {
+            ucontext_t * ucontext = static_cast<ucontext_t *>(context);
+#if defined(__x86_64__)
+            ucontext->uc_mcontext.gregs[REG_RIP] = reinterpret_cast<greg_t>(recovery);
+#else
+            ucontext->uc_mcontext.gregs[REG_EIP] = reinterpret_cast<greg_t>(recovery);
+#endif
+        }
+#endif
+        return;
+    }
+
+    //Pass other faults on to the previous handler
+    if(previousAction.sa_flags & SA_SIGINFO)
+    {
+        previousAction.sa_sigaction(signal, info, context);
+    }
+    else if(previousAction.sa_handler != SIG_IGN && previousAction.sa_handler != SIG_DFL)
+    {
+        previousAction.sa_handler(signal);
+    }
+    else
+    {
+        //Restore the default action and return to fault again
+        ::sigaction(SIGSEGV, &previousAction, NULL);
+    }
+}
+
+static void installHandler()
+{
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = tapeSignalHandler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+
+    ::sigaction(SIGSEGV, &action, &previousAction);
+}
+
+#endif
+
+bf::Tape::Tape(std::size_t size)
+    : reserved_(NULL), reservedSize_(0), start_(NULL), size_(0), range_(-1)
+{
+    //Reserve the tape and guard regions without committing anything
+    size = (size + COMMIT_SIZE - 1) & ~static_cast<std::size_t>(COMMIT_SIZE - 1);
+    std::size_t reservedSize = size + 2 * BF_GUARD_SIZE;
+
+#ifdef _WIN32
+    void * reserved = ::VirtualAlloc(NULL, reservedSize, MEM_RESERVE, PAGE_NOACCESS);
+    if(reserved == NULL)
+        return;
+#else
+    void * reserved = ::mmap(NULL, reservedSize, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(reserved == MAP_FAILED)
+        return;
+#endif
+
+    std::lock_guard<std::mutex> lock(tapeRangesMutex);
+
+    //Find a free range
+    int i;
+    for(i = 0; i < MAX_TAPES; i++)
+    {
+        if(tapeRanges[i].end == NULL)
+            break;
+    }
+
+    if(i == MAX_TAPES)
+    {
+#ifdef _WIN32
+        ::VirtualFree(reserved, 0, MEM_RELEASE);
+#else
+        ::munmap(reserved, reservedSize);
+#endif
+        return;
+    }
+
+    if(!handlerInstalled)
+    {
+        installHandler();
+        handlerInstalled = true;
+    }
+
+    reserved_ = static_cast<char *>(reserved);
+    reservedSize_ = reservedSize;
+    start_ = reserved_ + BF_GUARD_SIZE;
+    size_ = size;
+
+    //Publish range
+    range_ = i;
+    tapeRanges[i].recovery = NULL;
+    tapeRanges[i].faulted = NULL;
+    tapeRanges[i].start = start_;
+    tapeRanges[i].end = start_ + size_;
+}
+
+bf::Tape::~Tape()
+{
+    if(reserved_ == NULL)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(tapeRangesMutex);
+
+        for(int i = 0; i < MAX_TAPES; i++)
+        {
+            if(tapeRanges[i].start == start_ && tapeRanges[i].end != NULL)
+            {
+                tapeRanges[i].end = NULL;
+                tapeRanges[i].start = NULL;
+                break;
+            }
+        }
+    }
+
+#ifdef _WIN32
+    ::VirtualFree(reserved_, 0, MEM_RELEASE);
+#else
+    ::munmap(reserved_, reservedSize_);
+#endif
+}
+
+bool bf::Tape::valid() const
+{
+    return reserved_ != NULL;
+}
+
+void * bf::Tape::getStart() const
+{
+    return start_;
+}
+
+std::size_t bf::Tape::getSize() const
+{
+    return size_;
+}
+
+void bf::Tape::setRecovery(void * recovery, bool volatile * faulted)
+{
+    if(range_ < 0)
+        return;
+
+    //Only Windows and Linux let the fault handler move the faulting thread
+#if defined(_WIN32) || defined(__linux__)
+    TapeRange& range = tapeRanges[range_];
+    range.recovery = NULL;
+    range.faulted = faulted;
+    range.recovery = recovery;
+#else
+    (void) recovery;
+    (void) faulted;
+#endif
+}
+
+void bf::Tape::clear()
+{
+    //Decommit the tape so it is faulted in again as zeros
+#ifdef _WIN32
+    ::VirtualFree(start_, size_, MEM_DECOMMIT);
+#else
+    ::mmap(start_, size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#endif
+}
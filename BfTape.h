@@ -0,0 +1,60 @@
+#ifndef _BFTAPE_H
+#define _BFTAPE_H
+
+// Brainfuck Tape
+//
+
+#include <cstddef>
+
+namespace bf
+{
+    // A tape reserved as a large range of virtual memory
+    //  Pages are committed when they are first accessed by a fault handler so
+    //  the generated code does not need any bounds checks. Accesses to the
+    //  guard regions before and after the tape print an error and exit
+    //  (unless a recovery address is set).
+    class Tape
+    {
+    private:
+        // Reserved range (including guard regions)
+        char * reserved_;
+        std::size_t reservedSize_;
+
+        // Usable part of the tape
+        char * start_;
+        std::size_t size_;
+
+        // Index of the tape's entry in the fault handler's list of tapes
+        int range_;
+
+        // Tapes cannot be copied
+        Tape(Tape const&);
+        Tape& operator=(Tape const&);
+
+    public:
+        // Reserves a new tape with the given maximum size (in bytes)
+        explicit Tape(std::size_t size);
+        ~Tape();
+
+        // Returns true if the tape was reserved successfully
+        bool valid() const;
+
+        // Gets the address of the first cell
+        void * getStart() const;
+
+        // Gets the maximum size of the tape (in bytes)
+        std::size_t getSize() const;
+
+        // Sets the code to continue at if the pointer leaves the tape
+        //  Instead of exiting, the faulting thread jumps to recovery (with
+        //  its other registers unchanged) and *faulted is set to true. This
+        //  is only supported on Windows and Linux (NULL to exit again).
+        void setRecovery(void * recovery, bool volatile * faulted);
+
+        // Sets every cell back to zero and releases the memory used
+        //  The tape must not be in use
+        void clear();
+    };
+}
+
+#endif
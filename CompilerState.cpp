@@ -1,18 +1,90 @@
 #include "BfCompiler.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+
 // CompilerState helper class
 //
 
-bf::CompilerState::CompilerState(void * output, std::size_t outputSize, void * heap,
-    unsigned char cellSize, EofCode eofCode)
-    : output_(reinterpret_cast<uint8_t *>(output)), outputSize_(outputSize),
-        heap_(heap), cellSize_(cellSize), eofCode_(eofCode), pos_(0), failed_(false)
+//Executes the cpuid instruction (returns false if the leaf is unsupported)
+static bool cpuid(unsigned leaf, unsigned regs[4])
 {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if(static_cast<unsigned>(info[0]) < leaf)
+        return false;
+
+    __cpuidex(info, leaf, 0);
+    for(int i = 0; i < 4; i++)
+        regs[i] = info[i];
+
+    return true;
+#else
+    return __get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3]) != 0;
+#endif
 }
 
-void * bf::CompilerState::getHeap() const
+bf::VectorExtension bf::detectVectorExtension()
+{
+    unsigned regs[4];
+
+    //SSE2 = CPUID.1:EDX[26]
+    if(!cpuid(1, regs) || (regs[3] & (1 << 26)) == 0)
+        return VECTOR_NONE;
+
+    //AVX2 requires the OS to save the ymm registers (OSXSAVE and XCR0[2:1])
+    if((regs[2] & (1 << 27)) == 0)
+        return VECTOR_SSE2;
+
+#ifdef _MSC_VER
+    unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    unsigned long long xcr0 = (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+
+    if((xcr0 & 6) != 6)
+        return VECTOR_SSE2;
+
+    //AVX2 = CPUID.7:EBX[5]
+    if(!cpuid(7, regs) || (regs[1] & (1 << 5)) == 0)
+        return VECTOR_SSE2;
+
+    return VECTOR_AVX2;
+}
+
+bf::CompilerState::CompilerState(void * output, std::uint32_t outputSize,
+    std::uint8_t cellSize, EofCode eofCode, Architecture arch)
+    : output_(reinterpret_cast<uint8_t *>(output)), outputSize_(outputSize), buffer_(NULL),
+        cellSize_(cellSize), eofCode_(eofCode), arch_(arch),
+        vector_(detectVectorExtension()), budgetChecks_(false), prefixSteps_(0), profile_(NULL), sourceMap_(NULL), dumpOutput_(NULL), errorLocation_(), faultExit_(0), pos_(0), failed_(false)
 {
-    return heap_;
+}
+
+bf::CompilerState::CompilerState(CodeBuffer& buffer,
+    std::uint8_t cellSize, EofCode eofCode, Architecture arch)
+    : output_(static_cast<uint8_t *>(buffer.getStart())),
+        outputSize_(static_cast<uint32_t>(buffer.getSize())), buffer_(&buffer),
+        cellSize_(cellSize), eofCode_(eofCode), arch_(arch),
+        vector_(detectVectorExtension()), budgetChecks_(false), prefixSteps_(0), profile_(NULL), sourceMap_(NULL), dumpOutput_(NULL), errorLocation_(), faultExit_(0), pos_(0), failed_(false)
+{
+}
+
+bool bf::CompilerState::grow()
+{
+    //Positions are 32-bit so the buffer can't be used past 4GB
+    if(buffer_ == NULL || pos_ == UINT32_MAX || !buffer_->grow(pos_ + 1))
+        return false;
+
+    std::size_t size = buffer_->getSize();
+    outputSize_ = size > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(size);
+    return true;
 }
 
 std::uint32_t bf::CompilerState::getPosition() const
@@ -35,6 +107,146 @@ bf::EofCode const& bf::CompilerState::getEofCode() const
     return eofCode_;
 }
 
+bf::Architecture bf::CompilerState::getArchitecture() const
+{
+    return arch_;
+}
+
+bf::VectorExtension bf::CompilerState::getVectorExtension() const
+{
+    return vector_;
+}
+
+void bf::CompilerState::setVectorExtension(VectorExtension vector)
+{
+    vector_ = vector;
+}
+
+bool bf::CompilerState::getBudgetChecks() const
+{
+    return budgetChecks_;
+}
+
+void bf::CompilerState::setBudgetChecks(bool budgetChecks)
+{
+    budgetChecks_ = budgetChecks;
+}
+
+std::uint64_t bf::CompilerState::getPrefixSteps() const
+{
+    return prefixSteps_;
+}
+
+void bf::CompilerState::setPrefixSteps(std::uint64_t prefixSteps)
+{
+    prefixSteps_ = prefixSteps;
+}
+
+bf::Profile * bf::CompilerState::getProfile() const
+{
+    return profile_;
+}
+
+void bf::CompilerState::setProfile(Profile * profile)
+{
+    profile_ = profile;
+}
+
+bf::SourceMap * bf::CompilerState::getSourceMap() const
+{
+    return sourceMap_;
+}
+
+void bf::CompilerState::setSourceMap(SourceMap * sourceMap)
+{
+    sourceMap_ = sourceMap;
+}
+
+bf::SourceLocation const& bf::CompilerState::getErrorLocation() const
+{
+    return errorLocation_;
+}
+
+void bf::CompilerState::setErrorLocation(SourceLocation const& location)
+{
+    errorLocation_ = location;
+}
+
+std::uint32_t bf::CompilerState::getFaultExit() const
+{
+    return faultExit_;
+}
+
+void bf::CompilerState::setFaultExit(std::uint32_t position)
+{
+    faultExit_ = position;
+}
+
+void bf::CompilerState::markSource(std::uint32_t sourcePos)
+{
+    if(sourceMap_ == NULL)
+        return;
+
+    //Only record changes of position, replacing entries covering no code
+    if(!sourceMap_->empty())
+    {
+        SourceMapEntry& last = sourceMap_->back();
+
+        if(last.sourcePos == sourcePos)
+            return;
+
+        if(last.codePos == pos_)
+        {
+            last.sourcePos = sourcePos;
+            return;
+        }
+    }
+
+    SourceMapEntry entry = { pos_, sourcePos };
+    sourceMap_->push_back(entry);
+}
+
+std::ostream * bf::CompilerState::getDumpOutput() const
+{
+    return dumpOutput_;
+}
+
+void bf::CompilerState::setDumpOutput(std::ostream * dumpOutput)
+{
+    dumpOutput_ = dumpOutput;
+}
+
+bf::CodeBuffer * bf::CompilerState::getCodeBuffer() const
+{
+    return buffer_;
+}
+
+void bf::CompilerState::reset()
+{
+    rewind(0);
+}
+
+void bf::CompilerState::rewind(std::uint32_t position)
+{
+    pos_ = position;
+    failed_ = false;
+    loopStack_ = std::stack<std::uint32_t>();
+
+    if(faultExit_ >= position)
+        faultExit_ = 0;
+
+    if(sourceMap_ != NULL)
+    {
+        while(!sourceMap_->empty() && sourceMap_->back().codePos >= position)
+            sourceMap_->pop_back();
+    }
+}
+
+void * bf::CompilerState::getAddress(std::uint32_t position) const
+{
+    return output_ + position;
+}
+
 std::stack<std::uint32_t>& bf::CompilerState::loopStack()
 {
     return loopStack_;
@@ -47,8 +259,8 @@ std::stack<std::uint32_t> const& bf::CompilerState::loopStack() const
 
 void bf::CompilerState::put(std::uint8_t b1)
 {
-    //Fail if at the end
-    if(pos_ >= outputSize_)
+    //Fail if at the end and the buffer can't grow
+    if(pos_ >= outputSize_ && !grow())
         failed_ = true;
     else
         output_[pos_++] = b1;
@@ -87,6 +299,12 @@ void bf::CompilerState::putInt(std::uint32_t number)
         static_cast<std::uint8_t>(number >> 24));
 }
 
+void bf::CompilerState::putLong(std::uint64_t number)
+{
+    putInt(static_cast<std::uint32_t>(number));
+    putInt(static_cast<std::uint32_t>(number >> 32));
+}
+
 // Relative position putter
 void bf::CompilerState::putRelative(std::uint32_t relPosition)
 {
@@ -95,23 +313,33 @@ void bf::CompilerState::putRelative(std::uint32_t relPosition)
 
 void bf::CompilerState::putRelative(void * rawPointer)
 {
-    putRelative(reinterpret_cast<uint8_t *>(rawPointer) - output_);
+    putRelative(static_cast<std::uint32_t>(reinterpret_cast<uint8_t *>(rawPointer) - output_));
 }
 
 // Put at (can only be used to put at PREVIOUS positions)
 void bf::CompilerState::putAt(std::uint32_t position, std::uint8_t number)
 {
+    //Ignore positions which failed to be written
+    if(position >= outputSize_)
+        return;
+
     output_[position] = number;
 }
 
 void bf::CompilerState::putShortAt(std::uint32_t position, std::uint16_t number)
 {
+    if(position + 2 > outputSize_)
+        return;
+
     output_[position]     = static_cast<uint8_t>(number);
     output_[position + 1] = static_cast<uint8_t>(number >> 8);
 }
 
 void bf::CompilerState::putIntAt(std::uint32_t position, std::uint32_t number)
 {
+    if(position + 4 > outputSize_)
+        return;
+
     output_[position]     = static_cast<uint8_t>(number);
     output_[position + 1] = static_cast<uint8_t>(number >> 8);
     output_[position + 2] = static_cast<uint8_t>(number >> 16);
@@ -125,5 +353,5 @@ void bf::CompilerState::putRelativeAt(std::uint32_t position, std::uint32_t relP
 
 void bf::CompilerState::putRelativeAt(std::uint32_t position, void * rawPointer)
 {
-    putRelativeAt(position, reinterpret_cast<uint8_t *>(rawPointer) - output_);
+    putRelativeAt(position, static_cast<std::uint32_t>(reinterpret_cast<uint8_t *>(rawPointer) - output_));
 }
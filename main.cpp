@@ -1,100 +1,188 @@
-#include <Windows.h>
+#include <cstddef>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <cstdlib>
 #include <cstring>
-#include <memory>
+#include <sstream>
 #include <string>
+#include <vector>
+#include "BfBatch.h"
+#include "BfBenchmark.h"
 #include "BfCompiler.h"
+#include "BfCache.h"
+#include "BfCodeBuffer.h"
+#include "BfDebugInfo.h"
+#include "BfExecutable.h"
+#include "BfProfile.h"
+#include "BfTape.h"
 
 // Compiler Options
-#define CODE_SIZE (1024 * 1024)      // 1MB
-#define HEAP_SIZE (1024 * 1024)      // 1MB
+//  Code memory is reserved up front and only used as the code grows
+#if defined(_M_X64) || defined(__x86_64__)
+#define CODE_SIZE (std::size_t(1) << 30)     // 1GB
+#define TAPE_SIZE (std::size_t(8) << 30)     // 8GB
+#else
+#define CODE_SIZE (std::size_t(64) << 20)    // 64MB
+#define TAPE_SIZE (std::size_t(256) << 20)   // 256MB
+#endif
+
+//Tape size of standalone executables
+// Their tape is reserved when they start so it is smaller than the compiler's
+#define EXECUTABLE_TAPE_SIZE (std::size_t(256) << 20)   // 256MB
+
 #define CELL_SIZE 1
 #define EOF_CODE (bf::EofCode(-1))
 
-// VirtualFree unique_ptr deleter
-class VirtualFreeDeleter
+//Most operations of the program run by the compiler (before any input is read)
+#define PREFIX_STEPS 10000000
+
+//Size of the blocks the source is read in
+#define READ_BUFFER_SIZE (64 * 1024)
+
+// Command line options
+struct Options
 {
-public:
-    void operator()(void * ptr)
-    {
-        if(ptr != NULL)
-            ::VirtualFree(ptr, 0, MEM_RELEASE);
-    }
-};
+    std::string input;                  // File to read the program from
+    std::string output;                 // File to write the compiled code to
+    std::string executable;             // File to write a standalone executable to
+    bool dumpIr;                        // Dump the IR after each pass
+    bool useCache;                      // Use the compiled code cache
+    bool lazy;                          // Compile lazily
+    bool tiered;                        // Interpret and compile hot loops
+    bool profile;                       // Count loop iterations and report the hottest loops
+    bool sampleProfile;                 // Sample the running code and report the hottest loops
+    bool debugInfo;                     // Publish symbols for perf and gdb
+    std::uint64_t prefixSteps;          // Most operations run at compile time (0 = none)
 
-typedef std::unique_ptr<void, VirtualFreeDeleter> VirtualAllocPtr;
+    std::vector<std::string> batch;     // Input files to run the program with (-b)
+    unsigned threads;                   // Threads used for batches (0 = all processors)
+
+    bool benchmark;                     // Run the benchmarks
+    std::vector<std::string> benchmarks;// Extra programs to benchmark
+};
 
 // Private Functions
 static void printHelp();
-static bool parseArgs(int argc, char const ** argv, std::string& input, std::string& output);
+static bool parseArgs(int argc, char const ** argv, Options& options);
+static bool readSource(std::istream& input, std::string& source);
+static int run(Options const& options, void const * code, bf::Tape& tape);
 
 int main(int argc, char const ** argv)
 {
-    std::string inputName, outputName;
+    Options options;
 
     //Parse args
-    if(!parseArgs(argc, argv, inputName, outputName))
+    if(!parseArgs(argc, argv, options))
     {
         printHelp();
         return 1;
     }
 
-    //Open files
-    std::ifstream inputFile;
-    std::streambuf * inputFileBuf;
-    std::ofstream output;
+    //Benchmarks use their own memory
+    if(options.benchmark)
+    {
+        return bf::runBenchmarks(options.benchmarks, std::cout,
+            CODE_SIZE, TAPE_SIZE, CELL_SIZE, EOF_CODE) ? 0 : 1;
+    }
 
-    if(inputName.empty())
+    //Allocate tape
+    bf::Tape tape(TAPE_SIZE);
+    if(!tape.valid())
     {
-        //Using stdin
-        inputFileBuf = std::cin.rdbuf();
+        std::cerr << "Failed to allocate heap memory" << std::endl;
+        return 1;
     }
-    else
+
+    //Run previously compiled artifacts directly
+    if(!options.input.empty() && bf::isArtifact(options.input))
     {
-        //Using a file
-        inputFile.open(inputName, std::ios::in);
-        if(!inputFile)
+        bf::Artifact artifact;
+        if(!artifact.load(options.input))
         {
-            std::cerr << "Failed to open input file: " << inputName << std::endl;
+            std::cerr << "Compiled file cannot be run on this machine: " << options.input << std::endl;
             return 1;
         }
 
-        inputFileBuf = inputFile.rdbuf();
+        return run(options, artifact.getCode(), tape);
     }
 
-    if(outputName.empty())
-    {
-        //Force output file to fail to write anything
-        output.setstate(std::ios::badbit);
-    }
-    else
+    //Read the source
+    std::ifstream inputFile;
+    std::istream * input = &std::cin;
+
+    if(!options.input.empty())
     {
         //Using a file
-        output.open(outputName, std::ios::out | std::ios::trunc | std::ios::binary);
-        if(!output)
+        inputFile.open(options.input, std::ios::in | std::ios::binary);
+        if(!inputFile)
         {
-            std::cerr << "Failed to open output file: " << outputName << std::endl;
+            std::cerr << "Failed to open input file: " << options.input << std::endl;
             return 1;
         }
-    }
 
-    //Create input
-    std::istream input(inputFileBuf);
+        input = &inputFile;
+    }
 
-    //Allocate memory
-    VirtualAllocPtr codePtr(::VirtualAlloc(NULL, CODE_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE));
-    VirtualAllocPtr heapPtr(::VirtualAlloc(NULL, HEAP_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    std::string source;
+    if(!readSource(*input, source))
+    {
+        std::cerr << "Error reading input stream" << std::endl;
+        return 1;
+    }
 
-    if(codePtr.get() == NULL || heapPtr.get() == NULL)
+    //Allocate code memory
+    bf::CodeBuffer code(CODE_SIZE);
+    if(!code.valid())
     {
-        std::cerr << "Failed to allocate code and heap memory" << std::endl;
+        std::cerr << "Failed to allocate code memory" << std::endl;
         return 1;
     }
 
+    bf::CompilerState state(code, CELL_SIZE, EOF_CODE);
+    if(options.dumpIr)
+        state.setDumpOutput(&std::cerr);
+
+    bf::Profile profile(options.sampleProfile ? bf::Profile::SAMPLE : bf::Profile::COUNT);
+    if(options.profile || options.sampleProfile)
+        state.setProfile(&profile);
+
+    bf::SourceMap sourceMap;
+    if(options.debugInfo)
+        state.setSourceMap(&sourceMap);
+
+    state.setPrefixSteps(options.prefixSteps);
+
+    //Executables may be run on other machines so only use SSE2 (which every
+    // x86-64 processor has)
+    if(!options.executable.empty() && state.getVectorExtension() > bf::VECTOR_SSE2)
+        state.setVectorExtension(bf::VECTOR_SSE2);
+
+    //Try the cache (dumping the IR or publishing symbols always compiles the program)
+    std::uint64_t key = bf::getCacheKey(source, state);
+    std::string cachePath;
+
+    if(options.useCache && !options.dumpIr && !options.debugInfo)
+    {
+        cachePath = bf::getCachePath(key);
+
+        bf::Artifact cached;
+        if(!cachePath.empty() && cached.load(cachePath) && cached.getKey() == key)
+            return run(options, cached.getCode(), tape);
+    }
+
     //Compile program
-    bf::CompilerState state(codePtr.get(), CODE_SIZE, heapPtr.get(), CELL_SIZE, EOF_CODE);
-    switch(bf::compile(input, state))
+    std::istringstream sourceStream(source);
+    bf::CompileResult result;
+
+    if(options.lazy)
+        result = bf::executeLazy(sourceStream, state, tape.getStart());
+    else if(options.tiered)
+        result = bf::executeTiered(sourceStream, state, tape.getStart());
+    else
+        result = bf::compile(sourceStream, state);
+
+    switch(result)
     {
     case bf::IO_ERROR:
         std::cerr << "Error reading input stream" << std::endl;
@@ -105,16 +193,94 @@ int main(int argc, char const ** argv)
         return 1;
 
     case bf::MISMATCHED_BRAKETS:
-        std::cerr << "Mismatched brakets" << std::endl;
+        std::cerr << "Mismatched brakets at line " << state.getErrorLocation().line <<
+            ", column " << state.getErrorLocation().column << std::endl;
+        return 1;
+
+    case bf::OK:
+        break;
+    }
+
+    //Lazily compiled and interpreted programs have already been run
+    if(options.lazy || options.tiered)
+        return 0;
+
+    //Write to output and cache
+    if(!options.output.empty() && !bf::saveArtifact(options.output, state, key))
+    {
+        std::cerr << "Failed to write output file: " << options.output << std::endl;
+        return 1;
+    }
+
+    if(!cachePath.empty())
+        bf::saveArtifact(cachePath, state, key);
+
+    //Executables are written instead of running the program
+    if(!options.executable.empty())
+    {
+        if(!bf::writeExecutable(options.executable, state, EXECUTABLE_TAPE_SIZE))
+        {
+            std::cerr << "Failed to write executable: " << options.executable << std::endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    //Make code executable
+    if(!code.protectExecutable())
+    {
+        std::cerr << "Failed to make code memory executable" << std::endl;
         return 1;
     }
 
-    //Write to output
-    output.write(reinterpret_cast<char *>(codePtr.get()), state.getPosition());
+    //Publish symbols (the program still runs without them)
+    bf::DebugInfo debugInfo;
+    if(options.debugInfo && !debugInfo.publish(code.getStart(), state.getPosition(), sourceMap, source))
+        std::cerr << "Failed to publish debug information" << std::endl;
 
     //Execute code
-    reinterpret_cast<void (*)()>(codePtr.get())();
-    return 0;
+    if(state.getProfile() != NULL)
+    {
+        if(!bf::executeProfiled(code.getStart(), state.getPosition(), tape.getStart(), profile))
+        {
+            std::cerr << "Sampling is not supported on this platform" << std::endl;
+            return 1;
+        }
+
+        profile.writeReport(std::cerr, source);
+        return 0;
+    }
+
+    return run(options, code.getStart(), tape);
+}
+
+//Runs compiled code with stdin or every input in the batch
+// Returns the exit code of the program
+static int run(Options const& options, void const * code, bf::Tape& tape)
+{
+    if(options.batch.empty())
+    {
+        bf::execute(code, tape.getStart());
+        return 0;
+    }
+
+    return bf::runBatch(code, tape.getSize(), options.batch, options.threads) ? 0 : 1;
+}
+
+//Reads the whole source from the given stream
+// Returns false on errors
+static bool readSource(std::istream& input, std::string& source)
+{
+    char buffer[READ_BUFFER_SIZE];
+
+    while(input)
+    {
+        input.read(buffer, READ_BUFFER_SIZE);
+        source.append(buffer, static_cast<std::size_t>(input.gcount()));
+    }
+
+    return !input.bad();
 }
 
 // Print program usage
@@ -123,26 +289,71 @@ static void printHelp()
     std::cerr << "Brainfuck Compiler - James Cowgill\n"
                  "\n"
                  "Usage:\n"
-                 " bfc [-o <output>] [<input>]\n"
+                 " bfc [-c] [-d] [-g] [-s <steps>] [-l | -t | -o <output>] [<input>]\n"
+                 " bfc [-d] [-g] [-p | -P] [<input>]\n"
+                 " bfc [-d] [-s <steps>] [-o <output>] -e <executable> [<input>]\n"
+                 " bfc [-c] [-d] [-g] [-s <steps>] [-o <output>] [-j <threads>] -b <input> <files>...\n"
+                 " bfc -B [<files>...]\n"
                  "\n"
                  "Compiles a Brainfuck program and runs it\n"
                  " <input>  = the file to read the program from\n"
                  "            if omitted, the program is read from stdin\n"
-                 " <output> = if specified, the raw x86 code is written to the file <output>\n"
-                 "            NOTE: the code is not executable as it contains hardcoded addresses";
+                 "            files previously written with -o are run without compiling\n"
+                 " <output> = if specified, the compiled code is also written to the file <output>\n"
+                 "            (it can only be run by bfc on a machine like this one)\n"
+                 " -e       = write a standalone Linux executable to <executable> instead of running\n"
+                 "            the program (the tape is 256MB and only SSE2 is used)\n"
+                 " -c       = cache compiled programs (in $XDG_CACHE_HOME/bfjit or ~/.cache/bfjit,\n"
+                 "            %LOCALAPPDATA%\\bfjit on Windows)\n"
+                 " -d       = dump the intermediate representation after each pass to stderr\n"
+                 " -g       = publish a symbol for each loop (bf_loop_<line>_<column>) to perf\n"
+                 "            through /tmp/perf-<pid>.map and to gdb (cannot be used with -l or -t)\n"
+                 " -l       = compile large loops and the rest of the program when first reached\n"
+                 "            (starts large programs sooner, cannot be used with -o)\n"
+                 " -t       = interpret the program and only compile loops which run for long\n"
+                 "            (starts short programs sooner, cannot be used with -l or -o)\n"
+                 " -b       = compile the program once and run it with each of <files> as stdin\n"
+                 "            on several threads (outputs are written in the order of <files>)\n"
+                 " -j       = number of threads used by -b (defaults to one per processor)\n"
+                 " -s       = run at most <steps> operations of the program while compiling it, up\n"
+                 "            to the first input (defaults to 10000000, 0 disables, not used by -l,\n"
+                 "            -t, -p or -P)\n"
+                 " -p       = count the entries and iterations of each loop and write the\n"
+                 "            hottest loops to stderr afterwards\n"
+                 " -P       = like -p but sample the running code instead of counting\n"
+                 "            (runs at full speed, Linux only)\n"
+                 " -B       = time the compiler and the code for the built-in benchmarks and\n"
+                 "            <files> (read with <file>.in as stdin) and write JSON to stdout\n";
 
     std::cerr << std::flush;
 }
 
-//Parses args and stores them in input and output
+//Parses args and stores them in options
 // Returns false to print help
-static bool parseArgs(int argc, char const ** argv, std::string& input, std::string& output)
+static bool parseArgs(int argc, char const ** argv, Options& options)
 {
     bool nextIsOutput = false;
+    bool nextIsExecutable = false;
+    bool nextIsThreads = false;
+    bool nextIsSteps = false;
+    bool batch = false;
 
     //Clear output
-    input.clear();
-    output.clear();
+    options.input.clear();
+    options.output.clear();
+    options.executable.clear();
+    options.dumpIr = false;
+    options.useCache = false;
+    options.lazy = false;
+    options.tiered = false;
+    options.profile = false;
+    options.sampleProfile = false;
+    options.debugInfo = false;
+    options.prefixSteps = PREFIX_STEPS;
+    options.batch.clear();
+    options.threads = 0;
+    options.benchmark = false;
+    options.benchmarks.clear();
 
     //Process args
     for(int i = 1; i < argc; i++)
@@ -152,32 +363,158 @@ static bool parseArgs(int argc, char const ** argv, std::string& input, std::str
         //Handle output option
         if(nextIsOutput)
         {
-            output.assign(arg);
+            options.output.assign(arg);
+        }
+        else if(nextIsExecutable)
+        {
+            options.executable.assign(arg);
+        }
+        else if(nextIsThreads)
+        {
+            options.threads = static_cast<unsigned>(std::strtoul(arg, NULL, 10));
+            if(options.threads == 0)
+                return false;
+        }
+        else if(nextIsSteps)
+        {
+            char * end;
+            options.prefixSteps = std::strtoull(arg, &end, 10);
+            if(*arg == '\0' || *end != '\0')
+                return false;
         }
         else if(std::strcmp(arg, "-o") == 0)
         {
             //Output already processed?
-            if(!output.empty())
+            if(!options.output.empty())
                 return false;
 
             nextIsOutput = true;
             continue;
         }
-        else if(!input.empty() ||
-            std::strcmp(arg, "-h") == 0 || std::strcmp(arg, "--help") == 0 || std::strcmp(arg, "/?") == 0)
+        else if(std::strcmp(arg, "-e") == 0)
+        {
+            //Executable already processed?
+            if(!options.executable.empty())
+                return false;
+
+            nextIsExecutable = true;
+            continue;
+        }
+        else if(std::strcmp(arg, "-j") == 0)
+        {
+            nextIsThreads = true;
+            continue;
+        }
+        else if(std::strcmp(arg, "-s") == 0)
         {
-            //Handle help option and too many inputs
+            nextIsSteps = true;
+            continue;
+        }
+        else if(std::strcmp(arg, "-d") == 0)
+        {
+            options.dumpIr = true;
+        }
+        else if(std::strcmp(arg, "-g") == 0)
+        {
+            options.debugInfo = true;
+        }
+        else if(std::strcmp(arg, "-c") == 0)
+        {
+            options.useCache = true;
+        }
+        else if(std::strcmp(arg, "-l") == 0)
+        {
+            options.lazy = true;
+        }
+        else if(std::strcmp(arg, "-t") == 0)
+        {
+            options.tiered = true;
+        }
+        else if(std::strcmp(arg, "-p") == 0)
+        {
+            options.profile = true;
+        }
+        else if(std::strcmp(arg, "-P") == 0)
+        {
+            options.sampleProfile = true;
+        }
+        else if(std::strcmp(arg, "-b") == 0)
+        {
+            batch = true;
+        }
+        else if(std::strcmp(arg, "-B") == 0)
+        {
+            options.benchmark = true;
+        }
+        else if(std::strcmp(arg, "-h") == 0 || std::strcmp(arg, "--help") == 0 || std::strcmp(arg, "/?") == 0)
+        {
+            //Handle help option
             return false;
         }
-        else
+        else if(options.benchmark)
+        {
+            //Programs to benchmark
+            options.benchmarks.push_back(arg);
+        }
+        else if(options.input.empty())
         {
             //Must be the input
-            input.assign(arg);
+            options.input.assign(arg);
+        }
+        else if(batch)
+        {
+            //Batch input files
+            options.batch.push_back(arg);
+        }
+        else
+        {
+            //Too many inputs
+            return false;
         }
 
         nextIsOutput = false;
+        nextIsExecutable = false;
+        nextIsThreads = false;
+        nextIsSteps = false;
     }
 
-    //Disallow dangling -o
-    return !nextIsOutput;
+    //Disallow dangling options
+    if(nextIsOutput || nextIsExecutable || nextIsThreads || nextIsSteps)
+        return false;
+
+    //Benchmarks can't be combined with anything else
+    if(options.benchmark)
+    {
+        if(!options.input.empty())
+            options.benchmarks.insert(options.benchmarks.begin(), options.input);
+
+        return !batch && options.output.empty() && !options.dumpIr && !options.useCache &&
+            !options.lazy && !options.tiered && !options.profile && !options.sampleProfile &&
+            !options.debugInfo && options.executable.empty() && options.threads == 0 &&
+            options.prefixSteps == PREFIX_STEPS;
+    }
+
+    //Executables are compiled up front and not run
+    if(!options.executable.empty())
+    {
+        return !batch && !options.useCache && !options.lazy && !options.tiered &&
+            !options.profile && !options.sampleProfile && !options.debugInfo;
+    }
+
+    //Profiled programs must be compiled up front and run once
+    if(options.profile || options.sampleProfile)
+    {
+        return !batch && options.output.empty() && !options.useCache &&
+            !options.lazy && !options.tiered && !(options.profile && options.sampleProfile);
+    }
+
+    //Batches need a program and at least one input file, and must be compiled
+    // up front
+    if(batch && (options.batch.empty() || options.lazy || options.tiered))
+        return false;
+
+    //Disallow code which isn't compiled up front being written to a file or
+    // having symbols published
+    return !((options.lazy || options.tiered) && (!options.output.empty() || options.debugInfo)) &&
+        !(options.lazy && options.tiered);
 }